@@ -0,0 +1,106 @@
+/*
+ *  slcan_bench.c
+ *  saabopentechproj
+ *
+ *  Microbenchmark of the SLCAN codec, frames per second for encoding and
+ *  decoding a mix of t, T, r and R records with 0...8 data bytes, half
+ *  of them with a timestamp. A program of its own:
+ *
+ *      cc -O2 -o slcan_bench bench/slcan_bench.c slcan.c
+ *      ./slcan_bench [frames]
+ *
+ */
+
+#include "../slcan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define BENCH_SET		1024	// distinct frames, cycled through
+
+static CANMsg frames[BENCH_SET];
+static char records[BENCH_SET][SLCAN_MAX_RECORD + 1];
+static int record_len[BENCH_SET];
+
+static double nowSeconds( void )
+{
+	struct timeval tv;
+
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Frames of every kind, and the records the adapter would send for them
+static int makeFrames( void )
+{
+	int i, k, len;
+
+	srand( 1 );
+	for ( i = 0; i < BENCH_SET; i++ ) {
+		memset( &frames[i], 0, sizeof( CANMsg ) );
+		frames[i].flags = ( i & 1 ? CANMSG_EXTENDED : 0 ) | ( i % 7 == 0 ? CANMSG_RTR : 0 );
+		frames[i].id = ( frames[i].flags & CANMSG_EXTENDED ) ? rand() & 0x1FFFFFFF : rand() & 0x7FF;
+		frames[i].len = i % 9;
+		if ( !( frames[i].flags & CANMSG_RTR ) ) {
+			for ( k = 0; k < frames[i].len; k++ ) {
+				frames[i].data[k] = rand();
+			}
+		}
+
+		len = slcanEncode( records[i], &frames[i] ) - 1;
+		if ( i & 2 ) {
+			frames[i].timestamp = rand() % SLCAN_TIMESTAMP_WRAP;
+			frames[i].flags |= CANMSG_TIMESTAMP;
+			sprintf( records[i] + len, "%04lX", frames[i].timestamp );
+			len += 4;
+		}
+		records[i][len] = 0;
+		record_len[i] = len;
+	}
+
+	// Everything must survive the round trip before it is worth timing
+	for ( i = 0; i < BENCH_SET; i++ ) {
+		CANMsg msg;
+
+		memset( &msg, 0, sizeof( msg ) );
+		if ( slcanDecode( records[i], record_len[i], &msg ) != SLCAN_FRAME ||
+			 memcmp( &msg, &frames[i], sizeof( msg ) ) != 0 ) {
+			printf( "Round trip failed for %s\n", records[i] );
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+	char buf[SLCAN_MAX_ENCODED];
+	CANMsg msg;
+	unsigned long check = 0;
+	long count = argc > 1 ? atol( argv[1] ) : 20000000;
+	long i;
+	double start, encode_s, decode_s;
+
+	if ( count <= 0 || makeFrames() != 0 ) {
+		return 1;
+	}
+
+	start = nowSeconds();
+	for ( i = 0; i < count; i++ ) {
+		check += slcanEncode( buf, &frames[i & ( BENCH_SET - 1 )] ) + buf[1];
+	}
+	encode_s = nowSeconds() - start;
+
+	start = nowSeconds();
+	for ( i = 0; i < count; i++ ) {
+		slcanDecode( records[i & ( BENCH_SET - 1 )], record_len[i & ( BENCH_SET - 1 )], &msg );
+		check += msg.id + msg.data[0];
+	}
+	decode_s = nowSeconds() - start;
+
+	printf( "encode: %6.1f M frames/s\n", count / encode_s / 1e6 );
+	printf( "decode: %6.1f M frames/s\n", count / decode_s / 1e6 );
+	printf( "(check %lu)\n", check );
+	return 0;
+}
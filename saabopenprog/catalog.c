@@ -0,0 +1,171 @@
+/*
+ *  catalog.c
+ *  saabopentechproj
+ *
+ *  The catalog file is mapped as it is, so a lookup is a pass over a few
+ *  hundred kilobytes of fixed size entries with nothing to parse.
+ *
+ */
+
+#include "catalog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Map a catalog. Returns 0, or -1 if it is missing or not one this
+// build wrote.
+int openCatalog( CATALOG *catalog, const char *filename )
+{
+	struct stat st;
+	const CATALOG_HEADER *header;
+	int fd;
+
+	memset( catalog, 0, sizeof( CATALOG ) );
+	fd = open( filename, O_RDONLY );
+	if ( fd < 0 ) {
+		return -1;
+	}
+	if ( fstat( fd, &st ) != 0 || st.st_size < (off_t)sizeof( CATALOG_HEADER ) ) {
+		close( fd );
+		return -1;
+	}
+	catalog->map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( catalog->map == MAP_FAILED ) {
+		catalog->map = NULL;
+		return -1;
+	}
+	catalog->map_size = st.st_size;
+
+	header = (const CATALOG_HEADER *)catalog->map;
+	if ( memcmp( header->magic, CATALOG_MAGIC, sizeof( header->magic ) ) != 0 ||
+		 header->entry_size != sizeof( CATALOG_ENTRY ) ||
+		 sizeof( CATALOG_HEADER ) + (size_t)header->count * sizeof( CATALOG_ENTRY ) + header->strings != catalog->map_size ) {
+		closeCatalog( catalog );
+		return -1;
+	}
+	catalog->header = header;
+	catalog->entry = (const CATALOG_ENTRY *)( header + 1 );
+	catalog->strings = (const char *)( catalog->entry + header->count );
+	return 0;
+}
+
+void closeCatalog( CATALOG *catalog )
+{
+	if ( catalog->map != NULL ) {
+		munmap( catalog->map, catalog->map_size );
+	}
+	memset( catalog, 0, sizeof( CATALOG ) );
+}
+
+const char *catalogPath( const CATALOG *catalog, const CATALOG_ENTRY *entry )
+{
+	return entry->path < catalog->header->strings ? catalog->strings + entry->path : "";
+}
+
+// The entry of a file, by binary search since entries are sorted by name.
+// NULL if it is not in the catalog.
+const CATALOG_ENTRY *findCatalogPath( const CATALOG *catalog, const char *path )
+{
+	int low, high, middle, cmp;
+
+	if ( catalog->header == NULL ) {
+		return NULL;
+	}
+	low = 0;
+	high = (int)catalog->header->count - 1;
+	while ( low <= high ) {
+		middle = ( low + high ) / 2;
+		cmp = strcmp( catalogPath( catalog, &catalog->entry[middle] ), path );
+		if ( cmp == 0 ) {
+			return &catalog->entry[middle];
+		}
+		if ( cmp < 0 ) {
+			low = middle + 1;
+		}
+		else {
+			high = middle - 1;
+		}
+	}
+	return NULL;
+}
+
+// Write count entries and their file names, which must be sorted. The
+// catalog is written beside the old one and renamed over it, so a reader
+// never sees half of it. Returns 0, or -1 on failure.
+int writeCatalog( const char *filename, CATALOG_ENTRY *entries, int count, char **paths )
+{
+	CATALOG_HEADER header;
+	char temp_name[512];
+	FILE *f;
+	int i, ok;
+
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, CATALOG_MAGIC, sizeof( header.magic ) );
+	header.count = count;
+	header.entry_size = sizeof( CATALOG_ENTRY );
+	for ( i = 0; i < count; i++ ) {
+		entries[i].path = header.strings;
+		entries[i].file = i;
+		header.strings += strlen( paths[i] ) + 1;
+	}
+
+	snprintf( temp_name, sizeof( temp_name ), "%s.tmp", filename );
+	f = fopen( temp_name, "wb" );
+	if ( f == NULL ) {
+		return -1;
+	}
+	ok = fwrite( &header, sizeof( header ), 1, f ) == 1 &&
+		 ( count == 0 || fwrite( entries, sizeof( CATALOG_ENTRY ), count, f ) == (size_t)count );
+	for ( i = 0; ok && i < count; i++ ) {
+		ok = fwrite( paths[i], strlen( paths[i] ) + 1, 1, f ) == 1;
+	}
+	if ( fclose( f ) != 0 || !ok || rename( temp_name, filename ) != 0 ) {
+		unlink( temp_name );
+		return -1;
+	}
+	return 0;
+}
+
+// Test an entry against a query such as "sw=5382212". A value ending in
+// '*' matches as a prefix. Returns 1 or 0, or -1 for an unknown field.
+int matchCatalog( const CATALOG_ENTRY *entry, const char *query )
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} fields[] = {
+		{ "vin", offsetof( CATALOG_ENTRY, vin ) },
+		{ "hw", offsetof( CATALOG_ENTRY, hw ) },
+		{ "sw", offsetof( CATALOG_ENTRY, sw ) },
+		{ "version", offsetof( CATALOG_ENTRY, version ) },
+		{ "engine", offsetof( CATALOG_ENTRY, engine ) },
+		{ "tester", offsetof( CATALOG_ENTRY, tester ) },
+		{ "date", offsetof( CATALOG_ENTRY, date ) },
+	};
+	const char *value, *field;
+	size_t name_len, len;
+	int i;
+
+	value = strchr( query, '=' );
+	if ( value == NULL ) {
+		return -1;
+	}
+	name_len = value - query;
+	value++;
+	for ( i = 0; i < (int)( sizeof( fields ) / sizeof( fields[0] ) ); i++ ) {
+		if ( strlen( fields[i].name ) == name_len && strncmp( fields[i].name, query, name_len ) == 0 ) {
+			field = (const char *)entry + fields[i].offset;
+			len = strlen( value );
+			if ( len > 0 && value[len - 1] == '*' ) {
+				return strncmp( field, value, len - 1 ) == 0;
+			}
+			return strcmp( field, value ) == 0;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,66 @@
+/*
+ *  catalog.h
+ *  saabopentechproj
+ *
+ *  On-disk index of an archive of binaries: the header fields of each
+ *  one, so finding e.g. every binary with a given SW part number does not
+ *  mean reading them all again.
+ *
+ *  The file is a CATALOG_HEADER, the entries sorted by file name and then
+ *  the file names, NUL terminated.
+ *
+ */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+
+#define CATALOG_MAGIC		"T7CATLG1"
+
+// Entry flags
+#define CATALOG_MOTOROLA	0x01	// stored in Motorola byte order
+#define CATALOG_TIS			0x02	// a "TIS" binary
+#define CATALOG_BAD			0x80	// not a Trionic 7 binary, no fields
+
+typedef struct {
+	char vin[18];			// header field 0x90
+	char hw[12];			// 0x91
+	char sw[12];			// 0x94
+	char version[32];		// 0x95
+	char engine[16];		// 0x97
+	char tester[16];		// 0x98
+	char date[8];			// 0x99
+	unsigned char flags;
+	unsigned char reserved;
+	unsigned int checksum;	// byte sum, see scanImage()
+	unsigned int path;		// offset of the file name after the entries
+	unsigned int file;		// number in the file list while building
+	long long mtime;		// of the file when it was read
+	long long size;
+} CATALOG_ENTRY;
+
+typedef struct {
+	char magic[8];
+	unsigned int count;
+	unsigned int entry_size;	// sizeof( CATALOG_ENTRY ) of the writer
+	unsigned int strings;		// bytes of file names
+	unsigned int reserved;
+} CATALOG_HEADER;
+
+typedef struct {
+	void *map;
+	size_t map_size;
+	const CATALOG_HEADER *header;
+	const CATALOG_ENTRY *entry;
+	const char *strings;
+} CATALOG;
+
+int openCatalog( CATALOG *catalog, const char *filename );
+void closeCatalog( CATALOG *catalog );
+const char *catalogPath( const CATALOG *catalog, const CATALOG_ENTRY *entry );
+const CATALOG_ENTRY *findCatalogPath( const CATALOG *catalog, const char *path );
+int writeCatalog( const char *filename, CATALOG_ENTRY *entries, int count, char **paths );
+int matchCatalog( const CATALOG_ENTRY *entry, const char *query );
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ *  header_index.c
+ *  saabopentechproj
+ *
+ *  One backward walk over the header fields of a binary records where
+ *  each one is, so looking up the VIN, part numbers and so on does not
+ *  walk them again for every field.
+ *
+ */
+
+#include "header_index.h"
+#include <string.h>
+
+// The field that strip_header() keeps as the last one
+#define HEADER_STRIP_ID		0x92
+
+// Lowest offset strip_header() fills, relative to the end of the binary
+#define HEADER_STRIP_SPAN	0x300
+
+// Add field i to the list of its id
+static void linkField( HEADER_INDEX *index, int i )
+{
+	int id = index->field[i].id;
+
+	index->field[i].next = -1;
+	if ( index->first[id] < 0 ) {
+		index->first[id] = i;
+	}
+	else {
+		index->field[index->last[id]].next = i;
+	}
+	index->last[id] = i;
+}
+
+static void clearIndex( HEADER_INDEX *index )
+{
+	memset( index->first, 0xFF, sizeof( index->first ) );
+	memset( index->last, 0xFF, sizeof( index->last ) );
+}
+
+// Walk the fields from the end of the binary until a length of 0x00 or
+// 0xFF, or until the walk leaves the last HEADER_STRIP_SPAN bytes. Only
+// the fields that start within HEADER_SPAN are linked for lookups, the
+// rest are there for stripHeader()
+void indexHeader( HEADER_INDEX *index, const unsigned char *bin, long length )
+{
+	HEADER_FIELD *field;
+	long addr;
+
+	clearIndex( index );
+	index->end = length;
+	index->count = 0;
+	index->visible = 0;
+
+	for ( addr = length - 1; addr > length - HEADER_STRIP_SPAN && addr >= 1 && index->count < HEADER_MAX_FIELDS; ) {
+		if ( bin[addr] == 0x00 || bin[addr] == 0xFF ) {
+			break;
+		}
+		field = &index->field[index->count];
+		field->length = bin[addr];
+		field->id = bin[addr - 1];
+		field->data = addr - 2;
+		if ( field->data - field->length + 1 < 0 ) {
+			break;
+		}
+		if ( addr > length - HEADER_SPAN ) {
+			linkField( index, index->count );
+			index->visible = index->count + 1;
+		}
+		index->count++;
+
+		addr = field->data - field->length;
+	}
+}
+
+// The field with this id that was read last, since with several (mainly
+// VIN fields) that is the one that counts. NULL if there is none.
+const HEADER_FIELD *findHeaderField( const HEADER_INDEX *index, unsigned char id )
+{
+	return index->last[id] >= 0 ? &index->field[index->last[id]] : NULL;
+}
+
+// Copy a field's data into answer in reading order and terminate it.
+// Returns 1, or 0 if the binary has no such field.
+int getHeaderField( const HEADER_INDEX *index, const unsigned char *bin, unsigned char id, unsigned char *answer )
+{
+	const HEADER_FIELD *field = findHeaderField( index, id );
+	int i;
+
+	if ( field == NULL ) {
+		return 0;
+	}
+	for ( i = 0; i < field->length; i++ ) {
+		answer[i] = bin[field->data - i];
+	}
+	answer[field->length] = 0;
+	return 1;
+}
+
+// Fill everything below the first HEADER_STRIP_ID field with 0xFF, down
+// to HEADER_STRIP_SPAN bytes from the end, and drop what was filled from
+// the index. Returns 1, or 0 if there is no such field.
+int stripHeader( HEADER_INDEX *index, unsigned char *bin )
+{
+	const HEADER_FIELD *field;
+	long addr;
+	int i;
+
+	// Searched among all the fields, it may lie beyond HEADER_SPAN
+	for ( i = 0; i < index->count; i++ ) {
+		if ( index->field[i].id == HEADER_STRIP_ID ) {
+			break;
+		}
+	}
+	if ( i == index->count ) {
+		return 0;
+	}
+	field = &index->field[i];
+	for ( addr = field->data - field->length; addr > index->end - HEADER_STRIP_SPAN; addr-- ) {
+		bin[addr] = 0xFF;
+	}
+
+	// Only the fields up to and including it are left
+	index->count = i + 1;
+	if ( index->visible > index->count ) {
+		index->visible = index->count;
+	}
+	clearIndex( index );
+	for ( i = 0; i < index->visible; i++ ) {
+		linkField( index, i );
+	}
+	return 1;
+}
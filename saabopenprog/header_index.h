@@ -0,0 +1,38 @@
+/*
+ *  header_index.h
+ *  saabopentechproj
+ *
+ *  Index of the header fields at the end of a Trionic 7 binary. The
+ *  fields are read backwards from the last byte: a length byte, an id
+ *  byte and then the data, also stored backwards.
+ *
+ */
+
+#ifndef HEADER_INDEX_H
+#define HEADER_INDEX_H
+
+#define HEADER_SPAN			0x1FF	// bytes from the end that hold fields
+#define HEADER_MAX_FIELDS	256		// each field takes at least 2 bytes
+
+typedef struct {
+	unsigned char id;
+	unsigned char length;
+	long data;				// offset of the first data byte, the rest lie below it
+	short next;				// next field with the same id, -1 if none
+} HEADER_FIELD;
+
+typedef struct {
+	long end;				// length of the binary the index was built for
+	int count;
+	int visible;			// fields starting within HEADER_SPAN, the ones lookups see
+	HEADER_FIELD field[HEADER_MAX_FIELDS];	// in the order they were read
+	short first[256];		// by id, -1 if the id is not there
+	short last[256];
+} HEADER_INDEX;
+
+void indexHeader( HEADER_INDEX *index, const unsigned char *bin, long length );
+const HEADER_FIELD *findHeaderField( const HEADER_INDEX *index, unsigned char id );
+int getHeaderField( const HEADER_INDEX *index, const unsigned char *bin, unsigned char id, unsigned char *answer );
+int stripHeader( HEADER_INDEX *index, unsigned char *bin );
+
+#endif
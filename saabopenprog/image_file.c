@@ -0,0 +1,315 @@
+/*
+ *  image_file.c
+ *  saabopentechproj
+ *
+ *  Flash images backed by their file through mmap. A binary to be
+ *  written is mapped privately, so byte order fixes and header stripping
+ *  never reach the file. A dump is mapped shared: every byte stored by
+ *  read_trionic() is in the file's pages at once and survives the
+ *  process. The sidecar journal (file.bin.journal) starts with the
+ *  identity of the Trionic and then gets an address and CRC-32 record
+ *  for every IMAGE_CHUNK_SIZE bytes received; a chunk only counts as
+ *  read on a later attempt on the same Trionic if its data still has
+ *  that CRC.
+ *
+ */
+
+#include "image_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define IMAGE_MAP_BYTES		( IMAGE_CHUNKS / 8 )
+#define IMAGE_RECORD_SIZE	8		// address and CRC, both little endian
+
+static unsigned long crc_table[256];
+
+// CRC-32 as used by zip and Ethernet
+static unsigned long chunkCrc( const unsigned char *p, long length )
+{
+	unsigned long crc = 0xFFFFFFFF;
+	unsigned long c;
+	int i, k;
+
+	if ( crc_table[1] == 0 ) {
+		for ( i = 0; i < 256; i++ ) {
+			c = i;
+			for ( k = 0; k < 8; k++ ) {
+				c = ( c & 1 ) ? 0xEDB88320 ^ ( c >> 1 ) : c >> 1;
+			}
+			crc_table[i] = c;
+		}
+	}
+	while ( length-- > 0 ) {
+		crc = crc_table[( crc ^ *p++ ) & 0xFF] ^ ( crc >> 8 );
+	}
+	return crc ^ 0xFFFFFFFF;
+}
+
+static void putLong( unsigned char *p, unsigned long value )
+{
+	p[0] = value & 0xFF;
+	p[1] = ( value >> 8 ) & 0xFF;
+	p[2] = ( value >> 16 ) & 0xFF;
+	p[3] = ( value >> 24 ) & 0xFF;
+}
+
+static unsigned long getLong( const unsigned char *p )
+{
+	return p[0] | ( p[1] << 8 ) | ( (unsigned long)p[2] << 16 ) | ( (unsigned long)p[3] << 24 );
+}
+
+static void setChunkDone( IMAGE *image, long chunk )
+{
+	image->done[chunk >> 3] |= 1 << ( chunk & 7 );
+}
+
+// Mark the chunks of an earlier attempt whose data still matches the
+// record. A torn last record, or a chunk whose pages never made it to
+// disk, simply does not count and is read again.
+static void replayJournal( IMAGE *image )
+{
+	unsigned char record[IMAGE_RECORD_SIZE];
+	unsigned long address;
+	long chunk;
+
+	while ( read( image->journal_fd, record, IMAGE_RECORD_SIZE ) == IMAGE_RECORD_SIZE ) {
+		address = getLong( record );
+		if ( address % IMAGE_CHUNK_SIZE != 0 || address >= IMAGE_SIZE ) {
+			continue;
+		}
+		chunk = address / IMAGE_CHUNK_SIZE;
+		if ( !imageChunkDone( image, address ) &&
+			 chunkCrc( image->data + address, IMAGE_CHUNK_SIZE ) == getLong( record + 4 ) ) {
+			setChunkDone( image, chunk );
+			image->kept += IMAGE_CHUNK_SIZE;
+		}
+	}
+}
+
+// Map length bytes of fd for reading and writing, NULL on failure
+static unsigned char *mapFile( int fd, long length, int shared )
+{
+	void *p;
+
+	p = mmap( NULL, length, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0 );
+	return p == MAP_FAILED ? NULL : (unsigned char *)p;
+}
+
+// Load a binary to be written. A full size file is mapped, a shorter one
+// (a "TIS" binary) is read into a zeroed buffer since pages past the end
+// of a file cannot be touched. Returns 0, or -1 if it cannot be read.
+int loadImage( IMAGE *image, const char *filename )
+{
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	memset( image, 0, sizeof( IMAGE ) );
+	fd = open( filename, O_RDONLY );
+	if ( fd < 0 ) {
+		return -1;
+	}
+	if ( fstat( fd, &st ) != 0 ) {
+		close( fd );
+		return -1;
+	}
+	image->length = st.st_size < IMAGE_SIZE ? (long)st.st_size : IMAGE_SIZE;
+
+	if ( image->length == IMAGE_SIZE ) {
+		image->data = mapFile( fd, IMAGE_SIZE, 0 );
+		image->mapped = image->data != NULL;
+	}
+	if ( image->data == NULL ) {
+		image->data = calloc( IMAGE_SIZE, 1 );
+		if ( image->data != NULL ) {
+			n = pread( fd, image->data, image->length, 0 );
+			image->length = n > 0 ? (long)n : 0;
+		}
+	}
+
+	close( fd );
+	return image->data != NULL ? 0 : -1;
+}
+
+// Open the file a dump is read into. If its journal is there from an
+// earlier attempt both are left as they are for resumeImage(), otherwise
+// both start out empty. Returns 0, or -1 if either file cannot be set up.
+int createImage( IMAGE *image, const char *filename )
+{
+	struct stat st;
+	int keep;
+	int fd;
+
+	memset( image, 0, sizeof( IMAGE ) );
+	image->journal_fd = -1;
+	snprintf( image->journal_name, sizeof( image->journal_name ), "%s%s", filename, IMAGE_JOURNAL_SUFFIX );
+	keep = stat( filename, &st ) == 0 && st.st_size == IMAGE_SIZE &&
+		   stat( image->journal_name, &st ) == 0;
+
+	fd = open( filename, O_RDWR | O_CREAT | ( keep ? 0 : O_TRUNC ), 0644 );
+	if ( fd < 0 ) {
+		return -1;
+	}
+	if ( ftruncate( fd, IMAGE_SIZE ) == 0 ) {
+		image->data = mapFile( fd, IMAGE_SIZE, 1 );
+	}
+	close( fd );
+	image->mapped = 1;
+	image->length = IMAGE_SIZE;
+
+	image->done = calloc( IMAGE_MAP_BYTES, 1 );
+	if ( image->done != NULL ) {
+		image->journal_fd = open( image->journal_name, O_RDWR | O_CREAT | O_APPEND | ( keep ? 0 : O_TRUNC ), 0644 );
+	}
+	if ( image->data == NULL || image->done == NULL || image->journal_fd < 0 ) {
+		closeImage( image );
+		return -1;
+	}
+	return 0;
+}
+
+// Keep the chunks an earlier attempt vouched for (image->kept tells how
+// much) if it read the same Trionic, identified by the caller. Otherwise,
+// or if it cannot tell, the journal starts over with this identity.
+// Returns 0, or -1 if the journal cannot be written.
+int resumeImage( IMAGE *image, const char *identity )
+{
+	char record[IMAGE_IDENTITY_SIZE];
+	char previous[IMAGE_IDENTITY_SIZE];
+
+	if ( image->done == NULL ) {
+		return 0;
+	}
+	memset( record, 0, sizeof( record ) );
+	strncpy( record, identity, sizeof( record ) - 1 );
+	if ( record[0] != 0 &&
+		 pread( image->journal_fd, previous, sizeof( previous ), 0 ) == (ssize_t)sizeof( previous ) &&
+		 memcmp( record, previous, sizeof( record ) ) == 0 ) {
+		lseek( image->journal_fd, sizeof( previous ), SEEK_SET );
+		replayJournal( image );
+		return 0;
+	}
+
+	memset( image->done, 0, IMAGE_MAP_BYTES );
+	image->kept = 0;
+	if ( ftruncate( image->journal_fd, 0 ) != 0 ||
+		 write( image->journal_fd, record, sizeof( record ) ) != (ssize_t)sizeof( record ) ) {
+		return -1;
+	}
+	return 0;
+}
+
+// A zeroed image with no file behind it
+int allocImage( IMAGE *image )
+{
+	memset( image, 0, sizeof( IMAGE ) );
+	image->data = calloc( IMAGE_SIZE, 1 );
+	image->length = IMAGE_SIZE;
+	return image->data != NULL ? 0 : -1;
+}
+
+// Everything in [start, end) has been received. Only chunks that lie
+// wholly inside it are marked, and each one is journalled once.
+void markImage( IMAGE *image, long start, long end )
+{
+	unsigned char record[IMAGE_RECORD_SIZE];
+	long chunk;
+	long address;
+
+	if ( image->done == NULL ) {
+		return;
+	}
+	if ( end > IMAGE_SIZE ) {
+		end = IMAGE_SIZE;
+	}
+	for ( chunk = ( start + IMAGE_CHUNK_SIZE - 1 ) / IMAGE_CHUNK_SIZE;
+		  ( chunk + 1 ) * IMAGE_CHUNK_SIZE <= end; chunk++ ) {
+		address = chunk * IMAGE_CHUNK_SIZE;
+		if ( imageChunkDone( image, address ) ) {
+			continue;
+		}
+		setChunkDone( image, chunk );
+		putLong( record, address );
+		putLong( record + 4, chunkCrc( image->data + address, IMAGE_CHUNK_SIZE ) );
+		if ( write( image->journal_fd, record, IMAGE_RECORD_SIZE ) != IMAGE_RECORD_SIZE ) {
+			// Not fatal, the chunk is just read again next time
+		}
+	}
+}
+
+// Non-zero if the chunk holding offset has been received
+int imageChunkDone( const IMAGE *image, long offset )
+{
+	long chunk = offset / IMAGE_CHUNK_SIZE;
+
+	if ( image->done == NULL || offset < 0 || offset >= IMAGE_SIZE ) {
+		return 0;
+	}
+	return ( image->done[chunk >> 3] >> ( chunk & 7 ) ) & 1;
+}
+
+// Move *offset past the chunks already received and return how many bytes
+// from there up to end are still missing in one run. Without a journal
+// everything up to end is.
+long imageMissing( const IMAGE *image, long *offset, long end )
+{
+	long hole;
+
+	while ( *offset < end && imageChunkDone( image, *offset ) ) {
+		*offset = ( *offset / IMAGE_CHUNK_SIZE + 1 ) * IMAGE_CHUNK_SIZE;
+	}
+	if ( *offset > end ) {
+		*offset = end;
+	}
+	for ( hole = *offset; hole < end && !imageChunkDone( image, hole );
+		  hole = ( hole / IMAGE_CHUNK_SIZE + 1 ) * IMAGE_CHUNK_SIZE ) {
+	}
+	return ( hole < end ? hole : end ) - *offset;
+}
+
+// Push a dump and its journal out to disk. The CRCs make the order they
+// land in irrelevant. A complete dump needs no journal any more and it
+// is removed.
+int finishImage( IMAGE *image, int complete )
+{
+	int ret = 0;
+
+	if ( image->mapped && image->done != NULL ) {
+		if ( msync( image->data, IMAGE_SIZE, MS_SYNC ) != 0 ||
+			 fsync( image->journal_fd ) != 0 ) {
+			ret = -1;
+		}
+		if ( complete ) {
+			free( image->done );
+			image->done = NULL;
+			close( image->journal_fd );
+			image->journal_fd = -1;
+			unlink( image->journal_name );
+		}
+	}
+	return ret;
+}
+
+void closeImage( IMAGE *image )
+{
+	if ( image->data != NULL ) {
+		if ( image->mapped ) {
+			munmap( image->data, IMAGE_SIZE );
+		}
+		else {
+			free( image->data );
+		}
+	}
+	if ( image->done != NULL ) {
+		free( image->done );
+		if ( image->journal_fd >= 0 ) {
+			close( image->journal_fd );
+		}
+	}
+	memset( image, 0, sizeof( IMAGE ) );
+}
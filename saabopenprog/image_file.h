@@ -0,0 +1,45 @@
+/*
+ *  image_file.h
+ *  saabopentechproj
+ *
+ *  Flash images backed by their file through mmap. A dump being read
+ *  goes straight into the mapped output file, with a sidecar journal of
+ *  the chunks already received, so a dump cut short keeps what it got
+ *  and the next attempt on the same Trionic only reads the rest.
+ *
+ */
+
+#ifndef IMAGE_FILE_H
+#define IMAGE_FILE_H
+
+#define IMAGE_SIZE			( 512 * 1024 )
+#define IMAGE_CHUNK_SIZE	256		// bytes per journal record
+#define IMAGE_CHUNKS		( IMAGE_SIZE / IMAGE_CHUNK_SIZE )
+
+// Appended to the file name of a dump for its journal
+#define IMAGE_JOURNAL_SUFFIX	".journal"
+
+// The journal starts with the identity of the Trionic read, zero padded
+#define IMAGE_IDENTITY_SIZE	64
+
+typedef struct {
+	unsigned char *data;	// IMAGE_SIZE bytes
+	long length;			// bytes there were in the file loaded
+	int mapped;				// data is mapped, not allocated
+	unsigned char *done;	// bitmap of chunks received, NULL without a journal
+	int journal_fd;			// appended to as chunks arrive, valid with done
+	long kept;				// bytes the journal vouched for when opened
+	char journal_name[512];
+} IMAGE;
+
+int loadImage( IMAGE *image, const char *filename );
+int createImage( IMAGE *image, const char *filename );
+int resumeImage( IMAGE *image, const char *identity );
+int allocImage( IMAGE *image );
+void markImage( IMAGE *image, long start, long end );
+int imageChunkDone( const IMAGE *image, long offset );
+long imageMissing( const IMAGE *image, long *offset, long end );
+int finishImage( IMAGE *image, int complete );
+void closeImage( IMAGE *image );
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ *  image_scan.c
+ *  saabopentechproj
+ *
+ *  The byte swap, checksum and erased detection of a binary done 16 bytes
+ *  at a time, so that checking a library of images is limited by memory
+ *  bandwidth rather than by a byte loop. x86-64 always has SSE2 and
+ *  AArch64 always has NEON, so no compiler flags are needed; anything
+ *  else takes the portable loop.
+ *
+ */
+
+#include "image_scan.h"
+#include <string.h>
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#define SCAN_SSE2
+#elif defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#include <arm_neon.h>
+#define SCAN_NEON
+#endif
+
+// Fold one granule into the scan: swap it if needed, add it to the sum
+// and note whether it is erased
+static void scanGranule( unsigned char *p, int swap, IMAGE_SCAN *scan, long granule )
+{
+	unsigned long sum = 0;
+	int erased = 1;
+#if defined( SCAN_SSE2 )
+	__m128i v = _mm_loadu_si128( (const __m128i *)p );
+	__m128i s;
+
+	if ( swap ) {
+		v = _mm_or_si128( _mm_slli_epi16( v, 8 ), _mm_srli_epi16( v, 8 ) );
+		_mm_storeu_si128( (__m128i *)p, v );
+	}
+	s = _mm_sad_epu8( v, _mm_setzero_si128() );
+	sum = _mm_cvtsi128_si32( s ) + _mm_cvtsi128_si32( _mm_srli_si128( s, 8 ) );
+	erased = _mm_movemask_epi8( _mm_cmpeq_epi8( v, _mm_set1_epi8( (char)0xFF ) ) ) == 0xFFFF;
+#elif defined( SCAN_NEON )
+	uint8x16_t v = vld1q_u8( p );
+	uint64x2_t s;
+
+	if ( swap ) {
+		v = vrev16q_u8( v );
+		vst1q_u8( p, v );
+	}
+	s = vpaddlq_u32( vpaddlq_u16( vpaddlq_u8( v ) ) );
+	sum = (unsigned long)( vgetq_lane_u64( s, 0 ) + vgetq_lane_u64( s, 1 ) );
+	s = vreinterpretq_u64_u8( v );
+	erased = ( vgetq_lane_u64( s, 0 ) & vgetq_lane_u64( s, 1 ) ) == ~(uint64_t)0;
+#else
+	unsigned char temp;
+	int i;
+
+	for ( i = 0; i < SCAN_GRANULE; i += 2 ) {
+		if ( swap ) {
+			temp = p[i];
+			p[i] = p[i + 1];
+			p[i + 1] = temp;
+		}
+		sum += p[i] + p[i + 1];
+		erased &= ( p[i] & p[i + 1] ) == 0xFF;
+	}
+#endif
+
+	scan->checksum += sum;
+	if ( erased ) {
+		scan->erased_map[granule >> 3] |= 1 << ( granule & 7 );
+		scan->erased += SCAN_GRANULE;
+	}
+}
+
+// Check and prepare a binary that has just been loaded. A binary that
+// begins with FF FF FC EF is in Motorola byte order and is swapped in
+// place. length is rounded down to whole 16 bit words.
+void scanImage( unsigned char *data, long length, IMAGE_SCAN *scan )
+{
+	long offset;
+	unsigned char temp;
+
+	memset( scan, 0, sizeof( IMAGE_SCAN ) );
+	if ( length > IMAGE_SIZE ) {
+		length = IMAGE_SIZE;
+	}
+	length &= ~1L;
+	scan->motorola = length >= 4 && data[0] == 0xFF && data[1] == 0xFF && data[2] == 0xFC && data[3] == 0xEF;
+
+	for ( offset = 0; offset + SCAN_GRANULE <= length; offset += SCAN_GRANULE ) {
+		scanGranule( data + offset, scan->motorola, scan, offset / SCAN_GRANULE );
+	}
+
+	// A last part granule is never counted as erased
+	for ( ; offset < length; offset += 2 ) {
+		if ( scan->motorola ) {
+			temp = data[offset];
+			data[offset] = data[offset + 1];
+			data[offset + 1] = temp;
+		}
+		scan->checksum += data[offset] + data[offset + 1];
+	}
+
+	scan->signature = length >= 4 && data[0] == 0xFF && data[1] == 0xFF && data[2] == 0xEF && data[3] == 0xFC;
+}
+
+// Non-zero if the granule holding offset was all 0xFF when scanned
+int scanGranuleErased( const IMAGE_SCAN *scan, long offset )
+{
+	long granule = offset / SCAN_GRANULE;
+
+	if ( offset < 0 || offset >= IMAGE_SIZE ) {
+		return 0;
+	}
+	return ( scan->erased_map[granule >> 3] >> ( granule & 7 ) ) & 1;
+}
+
+// Non-zero if all length bytes at p are 0xFF
+int isErased( const unsigned char *p, long length )
+{
+#if defined( SCAN_SSE2 )
+	const __m128i ones = _mm_set1_epi8( (char)0xFF );
+
+	for ( ; length >= 16; length -= 16, p += 16 ) {
+		if ( _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)p ), ones ) ) != 0xFFFF ) {
+			return 0;
+		}
+	}
+#elif defined( SCAN_NEON )
+	uint64x2_t v;
+
+	for ( ; length >= 16; length -= 16, p += 16 ) {
+		v = vreinterpretq_u64_u8( vld1q_u8( p ) );
+		if ( ( vgetq_lane_u64( v, 0 ) & vgetq_lane_u64( v, 1 ) ) != ~(uint64_t)0 ) {
+			return 0;
+		}
+	}
+#endif
+	while ( length-- > 0 ) {
+		if ( *p++ != 0xFF ) {
+			return 0;
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,30 @@
+/*
+ *  image_scan.h
+ *  saabopentechproj
+ *
+ *  One pass over a loaded binary that fixes its byte order, sums it and
+ *  notes which parts are erased, using SSE2 or NEON where the compiler
+ *  offers them.
+ *
+ */
+
+#ifndef IMAGE_SCAN_H
+#define IMAGE_SCAN_H
+
+#include "image_file.h"
+
+#define SCAN_GRANULE		16		// bytes per bit of the erased map
+
+typedef struct {
+	int motorola;			// was in Motorola byte order and has been swapped
+	int signature;			// begins with FF FF EF FC (after any swap)
+	unsigned long checksum;	// 32 bit sum of all bytes (after any swap)
+	long erased;			// bytes in granules that are all 0xFF
+	unsigned char erased_map[IMAGE_SIZE / SCAN_GRANULE / 8];
+} IMAGE_SCAN;
+
+void scanImage( unsigned char *data, long length, IMAGE_SCAN *scan );
+int scanGranuleErased( const IMAGE_SCAN *scan, long offset );
+int isErased( const unsigned char *p, long length );
+
+#endif
@@ -13,382 +13,689 @@
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+// Longest single sleep in waitForRx(), bounds the cost of a wakeup that
+// slips in between the queue check and the condition wait
+#define RX_WAIT_SLICE_US	10000
+
+// Receive ring buffer, filled with one FT_Read per call to fillRxRing()
+// and parsed a complete CR terminated record at a time. The indexes run
+// freely and are masked on access.
+#define RX_RING_SIZE		8192	// must be a power of two
+#define RX_RING_MASK		( RX_RING_SIZE - 1 )
+
+// Frames decoded from the ring but not yet returned by readFrame()
+#define RX_FRAME_QUEUE		1024	// must be a power of two
+#define RX_FRAME_MASK		( RX_FRAME_QUEUE - 1 )
+
+// Ids with a receive queue of their own, see openRxQueue()
+#define RX_ID_QUEUES		8
+#define RX_ID_QUEUE_SIZE	256		// must be a power of two
+#define RX_ID_QUEUE_MASK	( RX_ID_QUEUE_SIZE - 1 )
+
+// Orders the frame copy against the index update in the id queues
+#define RX_BARRIER()		__sync_synchronize()
+
+// How long sendFrames() waits for the adapter to answer a burst
+#define TX_REPLY_TIMEOUT_US	100000
+
+// How long runCommands() waits for a script to be answered
+#define COMMAND_TIMEOUT_US	500000
+
+// Longest script runCommands() writes at once
+#define COMMAND_SCRIPT_MAX	( 8 * BUF_SIZE )
+
+// Steps in the script that opens the channel
+#define SETUP_STEPS			6
+
+// The adapter clock is compared with the host's over windows this long,
+// the quickest delivery of the last two windows sets the offset
+#define CLOCK_WINDOW_US		1000000
+
+// How often probeBitrate() asks for the status flags, and which of them
+// tell that the bitrate is wrong
+#define PROBE_POLL_US		5000
+#define PROBE_ERROR_FLAGS	( CANSTATUS_BUS_ERROR | CANSTATUS_ERROR_PASSIVE | CANSTATUS_ERROR_WARNING )
+
+// Most ids computeAcceptanceFilter() splits between the two filters,
+// it tries every split
+#define ACCEPTANCE_MAX_IDS	12
+
+static CANUSB_EVENT rx_event;
+static BOOL rx_event_initialized = FALSE;
+static BOOL rx_event_enabled = FALSE;
+
+static unsigned char rx_ring[RX_RING_SIZE];
+static unsigned int rx_head = 0;	// next byte written by fillRxRing()
+static unsigned int rx_tail = 0;	// next byte to parse
+
+static CANMsg rx_frames[RX_FRAME_QUEUE];
+static unsigned int rx_frame_head = 0;
+static unsigned int rx_frame_tail = 0;
+
+// Single producer, single consumer: head is only advanced by whoever
+// decodes frames (the receive thread while it runs), tail only by the
+// reader in readFrameId(), which needs no lock
+typedef struct {
+	unsigned long id;
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	CANMsg frames[RX_ID_QUEUE_SIZE];
+} RX_ID_QUEUE;
+
+static RX_ID_QUEUE rx_id_queues[RX_ID_QUEUES];
+static volatile int rx_id_queue_count = 0;
+
+// The receive state above and the counters below are guarded by rx_lock.
+// While the receive thread runs it is the only one reading from the
+// driver, and it broadcasts rx_cond after every batch it parses.
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rx_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t rx_thread;
+static volatile BOOL rx_thread_running = FALSE;
+
+// Every t/T/r/R we write is answered with z/Z or BELL, in order
+static unsigned int tx_sent = 0;
+static unsigned int tx_answered = 0;
+static unsigned int tx_refused = 0;
+static int tx_burst = CANUSB_TX_BURST_DEFAULT;
+
+// Last reply to the F command
+static unsigned int status_seq = 0;
+static int status_flags = 0;
+
+// Adapter timestamps (Z1), see enableTimestamps() and clockSample()
+static BOOL timestamps_enabled = FALSE;
+static long long rx_arrival_us = 0;		// when the bytes being parsed were read
+static BOOL clock_synced = FALSE;
+static long long clock_offset_us = 0;	// host minus adapter time
+static long long clock_window_min = 0;
+static long long clock_previous_min = 0;
+static long long clock_window_end = 0;
+
+// Receive statistics, only gathered while stats_enabled is set
+static BOOL stats_enabled = FALSE;
+static CANUSB_STATS stats;
+
+// Installed by setTransport(), NULL when talking to the adapter
+static const CANUSB_TRANSPORT *transport = NULL;
+
+static BOOL fillRxRing( FT_HANDLE ftHandle );
+static int nextRecord( char *line );
+static void dispatchFrame( const CANMsg *msg );
+static BOOL decodeFrame( const char *line, int len, CANMsg *msg );
+static void parseRxRing( void );
+static void waitOnRxCond( long timeout_us );
+static long long nowUs( void );
+static BOOL waitForTxReplies( FT_HANDLE ftHandle, long seq, long timeout_us );
 
 void initializeCanUsb()
 {
 	FT_SetVIDPID(0x0403,0xffa8);
 }
 
+// Route the frame functions to pTransport instead of the adapter, NULL
+// switches back
+void setTransport( const CANUSB_TRANSPORT *pTransport )
+{
+	transport = pTransport;
+}
+
 void getVersionInfo(FT_HANDLE ftHandle)
 {
-	FT_STATUS status;
-	char buf[BUF_SIZE];
-	char *p;
-	DWORD nBytesWritten;
-	DWORD eventStatus;
-	DWORD nRxCnt;// Number of characters in receive queue
-	DWORD nTxCnt;// Number of characters in transmit queue
-	
-	memset( buf, 0, sizeof( buf ) );
-	printf("getVersionInfo()\n");
-	
-	FT_Purge( ftHandle, FT_PURGE_RX | FT_PURGE_TX );
+	CANUSB_COMMAND step = { "V", FALSE, "" };
 	
-	sprintf( buf, "V\r" );
-	if ( FT_OK != ( status = FT_Write( ftHandle, buf, strlen( buf ), &nBytesWritten ) ) ) {
-		printf("Error: Failed to write command. return code = %d\n", status );
+	if ( transport ) {
 		return;
 	}
 	
-	// Check if there is something to receive
-	while ( 1 ){
-		
-		if ( FT_OK == FT_GetStatus( ftHandle, &nRxCnt, &nTxCnt, &eventStatus ) ) {
-			
-			// If there are characters to receive
-			if ( nRxCnt ) {
-				
-				if ( FT_OK != ( status = FT_Read( ftHandle, buf, nRxCnt, &nBytesWritten ) ) ) {
-					printf("Error: Failed to read data. return code = %d\n", status );
-					return;
-				}
-				
-				p = buf;
-				while ( *p ) {
-					if ( 0x0d == *p ) {
-						*p = 0;
-						break;
-					}
-					p++;
-				}
-				printf( "Version = %s\n", buf );
-				break;
-				
-			}
-			
-		}
-		else {
-			printf("Error: Failed to get status. return code = %d\n", status );
-			return;
-		}
-		
+	printf("getVersionInfo()\n");
+	if ( runCommands( ftHandle, &step, 1, COMMAND_TIMEOUT_US ) == 1 ) {
+		printf( "Version = %s\n", step.reply );
+	}
+	else {
+		printf( "Error: no answer to %s\n", step.command );
 	}
-	
 }
 
 // Turn ON the Time Stamp feature.
 void setTimeStampOn( FT_HANDLE ftHandle )
 {
-	FT_STATUS status;
-	char buf[BUF_SIZE];
-	char *p;
-	DWORD nBytesWritten;
-	DWORD eventStatus;
-	DWORD nRxCnt;// Number of characters in receive queue
-	DWORD nTxCnt;// Number of characters in transmit queue
+	CANUSB_COMMAND step = { "Z1", FALSE, "" };
 	
-	memset( buf, 0, sizeof( buf ) );
-	printf("setTimeStampOn()\n");
+	if ( transport ) {
+		return;
+	}
 	
-	FT_Purge( ftHandle, FT_PURGE_RX | FT_PURGE_TX );
+	printf("setTimeStampOn()\n");
+	if ( runCommands( ftHandle, &step, 1, COMMAND_TIMEOUT_US ) == 1 ) {
+		printf( "OK timestamp\n" );
+	}
+	else {
+		printf( "Error: adapter refused %s\n", step.command );
+	}
+}
+
+void setCodeRegister( FT_HANDLE ftHandle, unsigned long code )
+{
+	CANUSB_COMMAND step = { "", FALSE, "" };
 	
-	// code
-	sprintf( buf, "Z1\r" );
-	if ( FT_OK != ( status = FT_Write( ftHandle, buf, strlen( buf ), &nBytesWritten ) ) ) {
-		printf("Error: Failed to write command. return code = %d\n", status );
+	if ( transport ) {
 		return;
 	}
 	
-	// Check if there is something to receive
-	while ( 1 ){
-		
-		if ( FT_OK == FT_GetStatus( ftHandle, &nRxCnt, &nTxCnt, &eventStatus ) ) {
-			
-			// If there are characters to receive
-			if ( nRxCnt ) {
-				
-				if ( FT_OK != ( status = FT_Read( ftHandle, buf, nRxCnt, &nBytesWritten ) ) ) {
-					printf("Error: Failed to read data. return code = %d\n", status );
-					return;
-				}
-				
-				p = buf;
-				while ( *p ) {
-					if ( 0x0d == *p ) {
-						*p = 0;
-						break;
-					}
-					p++;
-				}
-				
-				printf( "OK timestamp\n", buf  );
-				break;
-				
-			}
-			
-		}
-		else {
-			printf("Error: Failed to get status. return code = %d\n", status );
-			return;
-		}
-		
-	}	
+	printf("setCodeRegister()\n");
+	sprintf( step.command, "M%08lX", code & 0xFFFFFFFFUL );
+	if ( runCommands( ftHandle, &step, 1, COMMAND_TIMEOUT_US ) == 1 ) {
+		printf( "OK code\n" );
+	}
+	else {
+		printf( "Error: adapter refused %s\n", step.command );
+	}
 }
 
-void setCodeRegister( FT_HANDLE ftHandle )
+void setMaskRegister( FT_HANDLE ftHandle, unsigned long mask )
 {
-	FT_STATUS status;
-	char buf[BUF_SIZE];
-	char *p;
-	DWORD nBytesWritten;
-	DWORD eventStatus;
-	DWORD nRxCnt;// Number of characters in receive queue
-	DWORD nTxCnt;// Number of characters in transmit queue
+	CANUSB_COMMAND step = { "", FALSE, "" };
 	
-	memset( buf, 0, sizeof( buf ) );
-	printf("setCodeRegister()\n");
+	if ( transport ) {
+		return;
+	}
 	
-	FT_Purge( ftHandle, FT_PURGE_RX | FT_PURGE_TX );
+	printf("setMaskRegister()\n");
+	sprintf( step.command, "m%08lX", mask & 0xFFFFFFFFUL );
+	if ( runCommands( ftHandle, &step, 1, COMMAND_TIMEOUT_US ) == 1 ) {
+		printf( "OK mask\n" );
+	}
+	else {
+		printf( "Error: adapter refused %s\n", step.command );
+	}
+}
+
+// One filter of the SJA1000 dual filter mode as a byte pair: id bits
+// 10..3 in the first byte, bits 2..0 and RTR at the top of the second.
+// A set mask bit is don't care. RTR must be 0, the data nibble that
+// filter 1 also looks at is don't care.
+static void packFilter( unsigned long id, unsigned long dont_care, unsigned long *code, unsigned long *mask )
+{
+	*code = ( ( id >> 3 ) << 8 ) | ( ( id & 7 ) << 5 );
+	*mask = ( ( dont_care >> 3 ) << 8 ) | ( ( dont_care & 7 ) << 5 ) | 0x0F;
+}
 
-	// code
-	sprintf( buf, "MFF5FFF5F\r" );
-	if ( FT_OK != ( status = FT_Write( ftHandle, buf, strlen( buf ), &nBytesWritten ) ) ) {
-		printf("Error: Failed to write command. return code = %d\n", status );
+// Tightest acceptance code and mask letting the standard data frames
+// with the given ids through. Both filters of the dual filter mode are
+// used, ids are split between them so the fewest other ids pass. No ids,
+// too many or an extended one gives the pair that accepts everything.
+void computeAcceptanceFilter( const unsigned long *ids, int count, unsigned long *code, unsigned long *mask )
+{
+	unsigned long split;
+	unsigned long base[2], diff[2];
+	unsigned long best_base[2] = { 0, 0 };
+	unsigned long best_diff[2] = { 0, 0 };
+	unsigned long cost, best_cost = ~0UL;
+	unsigned long code1, mask1, code2, mask2;
+	int used[2];
+	int i, g;
+	
+	*code = CANUSB_ACCEPT_ALL_CODE;
+	*mask = CANUSB_ACCEPT_ALL_MASK;
+	if ( count <= 0 || count > ACCEPTANCE_MAX_IDS ) {
 		return;
 	}
+	for ( i = 0; i < count; i++ ) {
+		if ( ids[i] > 0x7FF ) {
+			return;
+		}
+	}
 	
-	// Check if there is something to receive
-	while ( 1 ){
-		
-		if ( FT_OK == FT_GetStatus( ftHandle, &nRxCnt, &nTxCnt, &eventStatus ) ) {
-			
-			// If there are characters to receive
-			if ( nRxCnt ) {
-				
-				if ( FT_OK != ( status = FT_Read( ftHandle, buf, nRxCnt, &nBytesWritten ) ) ) {
-					printf("Error: Failed to read data. return code = %d\n", status );
-					return;
-				}
-				
-				p = buf;
-				while ( *p ) {
-					if ( 0x0d == *p ) {
-						*p = 0;
-						break;
-					}
-					p++;
-				}
-				
-				printf( "OK code\n", buf  );
-				break;
-				
+	// The first id always goes to filter 1, bit i-1 of split puts id i
+	// in filter 2. A filter passes 2^(don't care bits) ids.
+	for ( split = 0; split < ( 1UL << ( count - 1 ) ); split++ ) {
+		used[0] = used[1] = 0;
+		diff[0] = diff[1] = 0;
+		for ( i = 0; i < count; i++ ) {
+			g = i > 0 && ( ( split >> ( i - 1 ) ) & 1 );
+			if ( !used[g] ) {
+				base[g] = ids[i];
+				used[g] = 1;
 			}
-			
+			diff[g] |= ids[i] ^ base[g];
 		}
-		else {
-			printf("Error: Failed to get status. return code = %d\n", status );
-			return;
+		if ( !used[1] ) {
+			base[1] = base[0];
+			diff[1] = diff[0];
 		}
 		
-	}	
+		cost = 1UL << __builtin_popcountl( diff[0] );
+		if ( used[1] ) {
+			cost += 1UL << __builtin_popcountl( diff[1] );
+		}
+		if ( cost < best_cost ) {
+			best_cost = cost;
+			best_base[0] = base[0];
+			best_base[1] = base[1];
+			best_diff[0] = diff[0];
+			best_diff[1] = diff[1];
+		}
+	}
+	
+	packFilter( best_base[0] & ~best_diff[0], best_diff[0], &code1, &mask1 );
+	packFilter( best_base[1] & ~best_diff[1], best_diff[1], &code2, &mask2 );
+	*code = ( code1 << 16 ) | code2;
+	*mask = ( mask1 << 16 ) | mask2;
 }
 
-void setMaskRegister( FT_HANDLE ftHandle )
+// Change the acceptance filter of an open channel to let only ids
+// through. The code and mask can only be loaded with the channel closed,
+// so it is closed, loaded and opened again as one script. Returns FALSE
+// if the adapter refused any step of it.
+BOOL setAcceptanceFilter( FT_HANDLE ftHandle, const unsigned long *ids, int count )
 {
-	FT_STATUS status;
-	char buf[BUF_SIZE];
-	char *p;
-	DWORD nBytesWritten; 
-	DWORD eventStatus;
-	DWORD nRxCnt;// Number of characters in receive queue
-	DWORD nTxCnt;// Number of characters in transmit queue
+	CANUSB_COMMAND steps[] = {
+		{ "C", FALSE, "" },
+		{ "", FALSE, "" },		// acceptance code
+		{ "", FALSE, "" },		// acceptance mask
+		{ "O", FALSE, "" }
+	};
+	int total = sizeof( steps ) / sizeof( steps[0] );
+	unsigned long code;
+	unsigned long mask;
+	BOOL restart;
+	int done;
 	
-	memset( buf, 0, sizeof( buf ) );
-	printf("setMaskRegister()\n");
+	if ( transport ) {
+		return TRUE;
+	}
 	
-	FT_Purge( ftHandle, FT_PURGE_RX | FT_PURGE_TX );
+	computeAcceptanceFilter( ids, count, &code, &mask );
+	sprintf( steps[1].command, "M%08lX", code & 0xFFFFFFFFUL );
+	sprintf( steps[2].command, "m%08lX", mask & 0xFFFFFFFFUL );
+	
+	// Frames already written must reach the adapter before it closes
+	if ( !waitForTxReplies( ftHandle, -1, TX_REPLY_TIMEOUT_US ) ) {
+		return FALSE;
+	}
+	
+	// runCommands() matches the replies itself, the receive thread
+	// takes over again once they are in
+	restart = rx_thread_running;
+	stopRxThread();
+	done = runCommands( ftHandle, steps, total, COMMAND_TIMEOUT_US );
+	if ( restart ) {
+		startRxThread( ftHandle );
+	}
+	if ( done < total ) {
+		printf( "Error: adapter did not accept %s\n", steps[done].command );
+		return FALSE;
+	}
+	return TRUE;
+}
+
 
-	// Mask
-	sprintf( buf, "mFF1FFF1F\r" );
-	if ( FT_OK != ( status = FT_Write( ftHandle, buf, strlen( buf ), &nBytesWritten ) ) ) {
-		printf("Error: Failed to write command. return code = %d\n", status );
+void getSerialNumber( FT_HANDLE ftHandle )
+{
+	CANUSB_COMMAND step = { "N", FALSE, "" };
+	
+	if ( transport ) {
 		return;
 	}
 	
-	// Check if there is something to receive
-	while ( 1 ){
-		
-		if ( FT_OK == FT_GetStatus( ftHandle, &nRxCnt, &nTxCnt, &eventStatus ) ) {
-			
-			// If there are characters to receive
-			if ( nRxCnt ) {
-				
-				if ( FT_OK != ( status = FT_Read( ftHandle, buf, nRxCnt, &nBytesWritten ) ) ) {
-					printf("Error: Failed to read data. return code = %d\n", status );
-					return;
-				}
-				
-				p = buf;
-				while ( *p ) {
-					if ( 0x0d == *p ) {
-						*p = 0;
-						break;
-					}
-					p++;
-				}
-				
-				printf( "OK mask\n", buf  );
-				break;
-				
+	printf("getSerialNumber()\n");
+	if ( runCommands( ftHandle, &step, 1, COMMAND_TIMEOUT_US ) == 1 ) {
+		printf( "Serial = %s \n", step.reply );
+	}
+	else {
+		printf( "Error: no answer to %s\n", step.command );
+	}
+}
+
+// Fill adapters with the CANUSBs on this machine, up to max of them.
+// Returns how many were found.
+int listAdapters( CANUSB_ADAPTER *adapters, int max )
+{
+	FT_DEVICE_LIST_INFO_NODE *nodes;
+	DWORD count;
+	DWORD i;
+	int found = 0;
+	
+	if ( FT_OK != FT_CreateDeviceInfoList( &count ) || count == 0 ) {
+		return 0;
+	}
+	nodes = malloc( count * sizeof( FT_DEVICE_LIST_INFO_NODE ) );
+	if ( nodes == NULL ) {
+		return 0;
+	}
+	
+	if ( FT_OK == FT_GetDeviceInfoList( nodes, &count ) ) {
+		for ( i = 0; i < count && found < max; i++ ) {
+			if ( strncmp( nodes[i].Description, "CANUSB", 6 ) != 0 ) {
+				continue;
 			}
-			
+			strncpy( adapters[found].serial, nodes[i].SerialNumber, sizeof( adapters[found].serial ) - 1 );
+			adapters[found].serial[sizeof( adapters[found].serial ) - 1] = 0;
+			strncpy( adapters[found].description, nodes[i].Description, sizeof( adapters[found].description ) - 1 );
+			adapters[found].description[sizeof( adapters[found].description ) - 1] = 0;
+			adapters[found].in_use = ( nodes[i].Flags & FT_FLAGS_OPENED ) ? TRUE : FALSE;
+			found++;
 		}
-		else {
-			printf("Error: Failed to get status. return code = %d\n", status );
-			return;
-		}
-		
-	}	
+	}
+	
+	free( nodes );
+	return found;
+}
+
+// Set the FTDI latency timer (ms, 1 to 255) and the USB transfer size
+// for reading (bytes, a multiple of 64). Returns TRUE if the driver took
+// both and reads the latency timer back as set.
+BOOL setUsbTuning( FT_HANDLE ftHandle, unsigned int latency_ms, unsigned long transfer_size )
+{
+	UCHAR latency;
+	
+	if ( transport ) {
+		return TRUE;
+	}
+	if ( FT_OK != FT_SetUSBParameters( ftHandle, transfer_size, 0 ) ||
+		 FT_OK != FT_SetLatencyTimer( ftHandle, (UCHAR)latency_ms ) ||
+		 FT_OK != FT_GetLatencyTimer( ftHandle, &latency ) ) {
+		return FALSE;
+	}
+	return latency == latency_ms;
+}
+
+// Open the CANUSB with the given FTDI serial number, or the first one
+// found when serial is NULL
+FT_STATUS openAdapter( const char *serial, FT_HANDLE *pftHandle )
+{
+	if ( serial == NULL ) {
+		return FT_OpenEx( "CANUSB", FT_OPEN_BY_DESCRIPTION, pftHandle );
+	}
+	return FT_OpenEx( (PVOID)serial, FT_OPEN_BY_SERIAL_NUMBER, pftHandle );
 }
 
+// Fill in the setup script shared by openChannel() and probeBitrate():
+// close, timestamps on or off, accept every frame, bitrate, then open
+// the way the last step says
+static void setupScript( CANUSB_COMMAND *steps, const char *bitrate, const char *open )
+{
+	memset( steps, 0, SETUP_STEPS * sizeof( CANUSB_COMMAND ) );
+	strcpy( steps[0].command, "C" );	// in case it was left open, BELL if not
+	steps[0].may_fail = TRUE;
+	strcpy( steps[1].command, timestamps_enabled ? "Z1" : "Z0" );
+	sprintf( steps[2].command, "M%08lX", (unsigned long)CANUSB_ACCEPT_ALL_CODE );
+	sprintf( steps[3].command, "m%08lX", (unsigned long)CANUSB_ACCEPT_ALL_MASK );
+	strncpy( steps[4].command, bitrate, sizeof( steps[4].command ) - 1 );
+	steps[4].command[strcspn( steps[4].command, "\r" )] = 0;
+	strcpy( steps[5].command, open );
+}
 
-void getSerialNumber( FT_HANDLE ftHandle )
+// Forget everything received so far, from the driver up to the queues
+static void discardRx( FT_HANDLE ftHandle )
 {
-	FT_STATUS status;
-	char buf[BUF_SIZE];
-	char *p;
-	DWORD nBytesWritten;
-	DWORD eventStatus;
-	DWORD nRxCnt;// Number of characters in receive queue
-	DWORD nTxCnt;// Number of characters in transmit queue
+	int i;
 	
-	memset( buf, 0, sizeof( buf ) );
-	printf("getSerialNumber()\n");
+	FT_Purge( ftHandle, FT_PURGE_RX );
+	pthread_mutex_lock( &rx_lock );
+	rx_tail = rx_head;
+	rx_frame_tail = rx_frame_head;
+	for ( i = 0; i < rx_id_queue_count; i++ ) {
+		rx_id_queues[i].tail = rx_id_queues[i].head;
+	}
+	tx_answered = tx_sent;
+	clock_synced = FALSE;
+	pthread_mutex_unlock( &rx_lock );
+}
+
+// Open the channel at bitrate ("S6\r", "scb9a\r", ...) accepting every
+// frame; setAcceptanceFilter() narrows it once it is open. The whole
+// setup goes out as one script, so it costs a single round trip.
+BOOL openChannel( FT_HANDLE ftHandle, char* bitrate )
+{
+	CANUSB_COMMAND steps[SETUP_STEPS];
+	int done;
 	
-	FT_Purge( ftHandle, FT_PURGE_RX | FT_PURGE_TX );
+	if ( transport ) {
+		return TRUE;
+	}
 	
-	sprintf( buf, "N\r" );
-	if ( FT_OK != ( status = FT_Write( ftHandle, buf, strlen( buf ), &nBytesWritten ) ) ) {
-		printf("Error: Failed to write command. return code = %d\n", status );
-		return;
+	setupScript( steps, bitrate, "O" );
+	discardRx( ftHandle );
+	done = runCommands( ftHandle, steps, SETUP_STEPS, COMMAND_TIMEOUT_US );
+	if ( done < SETUP_STEPS ) {
+		printf( "Error: adapter did not accept %s\n", steps[done].command );
+		return FALSE;
+	}
+	
+	printf( "OK open\n" );
+	return TRUE;
+}
+
+static long long nowUs( void )
+{
+	struct timeval now;
+	
+	gettimeofday( &now, NULL );
+	return (long long)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+// Listen at bitrate for up to window_us without taking part in the bus:
+// the channel is opened listen-only (L), so a wrong guess neither
+// acknowledges nor destroys anyone's frames. A good frame means the
+// bitrate is right, the error flags in the F replies that it is wrong;
+// either ends the wait. Firmware without L gets a normal open instead.
+// The channel is left open, openChannel() closes it again.
+// Returns one of the CANUSB_PROBE_* results.
+int probeBitrate( FT_HANDLE ftHandle, const char *bitrate, long window_us )
+{
+	CANUSB_COMMAND steps[SETUP_STEPS];
+	char line[SLCAN_MAX_RECORD + 1];
+	unsigned long flags;
+	CANMsg msg;
+	DWORD retLen;
+	long long now, deadline, next_poll;
+	long slice;
+	BOOL asking;
+	int result;
+	int done;
+	int len;
+	
+	if ( transport ) {
+		return CANUSB_PROBE_TRAFFIC;
+	}
+	
+	setupScript( steps, bitrate, "L" );
+	discardRx( ftHandle );
+	done = runCommands( ftHandle, steps, SETUP_STEPS, COMMAND_TIMEOUT_US );
+	if ( done == SETUP_STEPS - 1 ) {
+		setupScript( steps, bitrate, "O" );
+		done = runCommands( ftHandle, steps, SETUP_STEPS, COMMAND_TIMEOUT_US );
+	}
+	if ( done < SETUP_STEPS ) {
+		return CANUSB_PROBE_FAILED;
 	}
 	
-	// Check if there is something to receive
-	while ( 1 ){
+	result = CANUSB_PROBE_SILENT;
+	asking = FALSE;
+	now = nowUs();
+	deadline = now + window_us;
+	next_poll = now;
+	
+	pthread_mutex_lock( &rx_lock );
+	while ( 1 ) {
+		if ( !asking && result == CANUSB_PROBE_SILENT && now >= next_poll && now < deadline ) {
+			if ( FT_OK != FT_Write( ftHandle, "F\r", 2, &retLen ) ) {
+				break;
+			}
+			asking = TRUE;
+			next_poll = now + PROBE_POLL_US;
+		}
 		
-		if ( FT_OK == FT_GetStatus( ftHandle, &nRxCnt, &nTxCnt, &eventStatus ) ) {
-			
-			// If there are characters to receive
-			if ( nRxCnt ) {
-				
-				if ( FT_OK != ( status = FT_Read( ftHandle, buf, nRxCnt, &nBytesWritten ) ) ) {
-					printf("Error: Failed to read data. return code = %d\n", status );
-					return;
-				}
-				
-				p = buf;
-				while ( *p ) {
-					if ( 0x0d == *p ) {
-						*p = 0;
-						break;
-					}
-					p++;
+		fillRxRing( ftHandle );
+		while ( ( len = nextRecord( line ) ) >= 0 ) {
+			memset( &msg, 0, sizeof( CANMsg ) );
+			if ( slcanDecode( line, len, &msg ) == SLCAN_FRAME ) {
+				dispatchFrame( &msg );
+				result = CANUSB_PROBE_TRAFFIC;
+			}
+			else if ( line[0] == 'F' && len == 3 && slcanHex( line + 1, 2, &flags ) == 0 ) {
+				asking = FALSE;
+				if ( ( flags & PROBE_ERROR_FLAGS ) && result == CANUSB_PROBE_SILENT ) {
+					result = CANUSB_PROBE_ERRORS;
 				}
-				
-				printf( "Serial = %s \n", buf  );
-				break;
-				
 			}
-			
 		}
-		else {
-			printf("Error: Failed to get status. return code = %d\n", status );
-			return;
+		
+		// An F still on its way would be taken for the reply to the
+		// next script, so it is waited for unless it never comes
+		now = nowUs();
+		if ( !asking && ( result != CANUSB_PROBE_SILENT || now >= deadline ) ) {
+			break;
+		}
+		if ( asking && now >= deadline + TX_REPLY_TIMEOUT_US ) {
+			break;
 		}
 		
+		slice = asking ? RX_WAIT_SLICE_US : (long)( ( next_poll < deadline ? next_poll : deadline ) - now );
+		if ( slice > RX_WAIT_SLICE_US ) {
+			slice = RX_WAIT_SLICE_US;
+		}
+		pthread_mutex_unlock( &rx_lock );
+		if ( slice > 0 ) {
+			waitForRx( ftHandle, slice );
+		}
+		pthread_mutex_lock( &rx_lock );
+		now = nowUs();
 	}
+	pthread_mutex_unlock( &rx_lock );
 	
+	return result;
 }
 
-BOOL openChannel( FT_HANDLE ftHandle, char* bitrate )
+// Try the bitrates in order until one has traffic, each for at most
+// window_us; a bitrate that only shows bus errors is given up on at
+// once. Returns the index of the bitrate found, or -1. The channel is
+// left open listen-only at that bitrate, ready for openChannel().
+int detectBitrate( FT_HANDLE ftHandle, const char * const *bitrates, int count, long window_us )
 {
-	char buf[BUF_SIZE];
-	DWORD retLen;
-	FT_STATUS status;
-	char *p;
-	DWORD nBytesWritten;
-	DWORD eventStatus;
-	DWORD nRxCnt;// Number of characters in receive queue
-	DWORD nTxCnt;// Number of characters in transmit queue
+	int i;
 	
-	// Set baudrate
-	FT_Purge( ftHandle, FT_PURGE_RX );
-	//sxxyy[CR] 
-	//Setup with BTR0/BTR1 CAN bit-rates where xx and yy is a hex value. 
-	//This command is only active if the CAN channel is closed.
-	//	xx	BTR0 value in hex yy	BTR1 value in hex
-	//	Example:	s031C[CR] Setup CAN with BTR0=0x03 & BTR1=0x1C
-	//	which equals to 125Kbit.
-	//	Returns:	CR (Ascii 13) for OK or BELL (Ascii 7) for ERROR.
-	if ( !( FT_OK == FT_Write( ftHandle, bitrate, strlen(bitrate), &retLen ) ) )
-	{ 
-		printf("Write failed\n");
-		return FALSE;
+	for ( i = 0; i < count; i++ ) {
+		if ( probeBitrate( ftHandle, bitrates[i], window_us ) == CANUSB_PROBE_TRAFFIC ) {
+			return i;
+		}
 	}
+	return -1;
+}
+
+// The FTDI serial number of an open adapter, what openAdapter() takes
+BOOL getAdapterSerial( FT_HANDLE ftHandle, char *serial, int size )
+{
+	char number[16];
+	char description[64];
+	FT_DEVICE type;
+	DWORD id;
 	
-	// Open device
-	FT_Purge( ftHandle, FT_PURGE_RX );
-	strcpy( buf, "O\r" );
-	if ( !( FT_OK == FT_Write( ftHandle, buf, 2, &retLen ) ) )
-	{
-		printf("Write failed\n");
+	if ( transport || FT_OK != FT_GetDeviceInfo( ftHandle, &type, &id, number, description, NULL ) ) {
 		return FALSE;
 	}
+	number[sizeof( number ) - 1] = 0;
+	snprintf( serial, size, "%s", number );
+	return serial[0] != 0;
+}
+
+
+// Send a script of adapter commands in one write and match the replies,
+// a CR (after any text such as a version) or a BELL, to the steps in
+// order. Frames that turn up in between are queued as usual, and bytes
+// after the last reply stay in the ring. Only for use while the receive
+// thread is stopped. Returns the number of steps that succeeded, count
+// if all of them did; steps[n].reply holds the text of each reply.
+int runCommands( FT_HANDLE ftHandle, CANUSB_COMMAND *steps, int count, long timeout_us )
+{
+	char buf[COMMAND_SCRIPT_MAX];
+	char line[SLCAN_MAX_RECORD + 1];
+	CANMsg msg;
+	DWORD retLen;
+	long slice;
+	int size;
+	int step;
+	int len;
+	int i;
+	
+	if ( rx_thread_running ) {
+		return 0;
+	}
+	
+	size = 0;
+	for ( i = 0; i < count; i++ ) {
+		len = strlen( steps[i].command );
+		if ( size + len + 1 > (int)sizeof( buf ) ) {
+			return 0;
+		}
+		memcpy( buf + size, steps[i].command, len );
+		size += len;
+		buf[size++] = 0x0d;
+		steps[i].reply[0] = 0;
+	}
+	if ( FT_OK != FT_Write( ftHandle, buf, size, &retLen ) || (int)retLen != size ) {
+		return 0;
+	}
 	
-	// Check if there is something to receive
-	while ( 1 ){
+	step = 0;
+	pthread_mutex_lock( &rx_lock );
+	while ( step < count ) {
+		fillRxRing( ftHandle );
 		
-		if ( FT_OK == FT_GetStatus( ftHandle, &nRxCnt, &nTxCnt, &eventStatus ) ) {
-			
-			// If there are characters to receive
-			if ( nRxCnt ) {
-				
-				if ( FT_OK != ( status = FT_Read( ftHandle, buf, nRxCnt, &nBytesWritten ) ) ) {
-					printf("Error: Failed to read data. return code = %d\n", status );
-					return;
+		while ( step < count && rx_tail != rx_head ) {
+			if ( rx_ring[rx_tail & RX_RING_MASK] == 0x07 ) {
+				rx_tail++;
+				if ( !steps[step].may_fail ) {
+					pthread_mutex_unlock( &rx_lock );
+					return step;
 				}
-				
-				p = buf;
-				while ( *p ) {
-					if ( 0x0d == *p ) {
-						*p = 0;
-						break;
-					}
-					p++;
-				}
-				
-				printf( "OK open\n", buf  );
+				step++;
+				continue;
+			}
+			if ( ( len = nextRecord( line ) ) < 0 ) {
 				break;
-				
 			}
-			
+			memset( &msg, 0, sizeof( CANMsg ) );
+			if ( slcanDecode( line, len, &msg ) == SLCAN_FRAME ) {
+				dispatchFrame( &msg );
+				continue;
+			}
+			snprintf( steps[step].reply, sizeof( steps[step].reply ), "%.*s", len, line );
+			step++;
 		}
-		else {
-			printf("Error: Failed to get status. return code = %d\n", status );
-			return;
+		if ( step == count ) {
+			break;
 		}
 		
-	}	
+		if ( timeout_us <= 0 ) {
+			break;
+		}
+		slice = RX_WAIT_SLICE_US < timeout_us ? RX_WAIT_SLICE_US : timeout_us;
+		timeout_us -= slice;
+		pthread_mutex_unlock( &rx_lock );
+		waitForRx( ftHandle, slice );
+		pthread_mutex_lock( &rx_lock );
+	}
+	pthread_mutex_unlock( &rx_lock );
 	
-	return TRUE;
+	return step;
 }
 
-
 BOOL closeChannel( FT_HANDLE ftHandle )
 {
 	char buf[BUF_SIZE];
 	DWORD retLen;
 	
+	stopRxThread();
+	if ( transport ) {
+		return TRUE;
+	}
+	
 	// Close device
 	FT_Purge( ftHandle, FT_PURGE_RX | FT_PURGE_TX );
 	strcpy( buf, "C\r" );
@@ -407,65 +714,218 @@ FT_STATUS setTimeouts( FT_HANDLE ftHandle, ULONG ReadTimeout, ULONG WriteTimeout
 
 BOOL sendFrame( FT_HANDLE ftHandle, CANMsg *pmsg )
 {
-	int i; 
 	char txbuf[BUF_SIZE];
 	unsigned long size;
 	DWORD retLen;
 	
-	retLen = 0;
-	
-	memset(txbuf, 0, sizeof(txbuf));
-	
-	if ( pmsg->flags & CANMSG_EXTENDED ) {
-		if ( pmsg->flags & CANMSG_RTR ) {
-			sprintf( txbuf, "R%8.8lX%i", pmsg->id, pmsg->len );
-			pmsg->len = 0; 
-		}
-		else {
-			sprintf( txbuf, "T%8.8lX%i", pmsg->id, pmsg->len );
-		}
-	}
-	else {
-		if ( pmsg->flags & CANMSG_RTR ) {
-			sprintf( txbuf, "r%3.3lX%i", pmsg->id, pmsg->len );
-			pmsg->len = 0; // Just dlc no data for RTR
-		}
-		else {
-			sprintf( txbuf, "t%3.3lX%i", pmsg->id, pmsg->len );
-		}
+	if ( transport ) {
+		return transport->send( transport->context, pmsg );
 	}
 	
-	if ( pmsg->len ) {
-		char hex[5];
-		
-		for ( i= 0; i< pmsg->len; i++ ) {
-			sprintf( hex, "%2.2X", pmsg->data[i] );
-			strcat( txbuf, hex );
-		}
-	}
+	retLen = 0;
 	
-	// Add CR
-	strcat( txbuf, "\r" );	
-	size = strlen( txbuf );
+	size = slcanEncode( txbuf, pmsg );
 	
 	// Transmit frame
+	pthread_mutex_lock( &rx_lock );
 	if ( !( FT_OK == FT_Write( ftHandle, txbuf, size, &retLen ) ) )
 	{ 
+		pthread_mutex_unlock( &rx_lock );
 		return FALSE;
 	}
+	tx_sent++;
+	pthread_mutex_unlock( &rx_lock );
 	
 	return TRUE;
 }
 
-FT_STATUS writeCommand( FT_HANDLE ftHandle, char *cmd, int cmd_size ) 
+// Write count frames in one FT_Write without waiting for the adapter to
+// answer. Meant for short runs such as an acknowledgement followed by the
+// next request, which cannot overflow the transmit FIFO.
+BOOL queueFrames( FT_HANDLE ftHandle, const CANMsg *msgs, int count )
 {
-	FT_STATUS ret;
-	DWORD bytes_written = 0;
-	ret = FT_Write( ftHandle, cmd, cmd_size, &bytes_written);
-	return ret;
-}
-
-FT_STATUS readCommand( FT_HANDLE ftHandle, int length, char *cmd, int *cmd_size ) 
+	char txbuf[CANUSB_TX_BURST_MAX * ( SLCAN_MAX_RECORD + 1 )];
+	int size = 0;
+	int i;
+	DWORD retLen;
+	
+	if ( count > CANUSB_TX_BURST_MAX ) {
+		return FALSE;
+	}
+	if ( transport ) {
+		for ( i = 0; i < count; i++ ) {
+			if ( !transport->send( transport->context, &msgs[i] ) ) {
+				return FALSE;
+			}
+		}
+		return TRUE;
+	}
+	for ( i = 0; i < count; i++ ) {
+		size += slcanEncode( txbuf + size, &msgs[i] );
+	}
+	
+	pthread_mutex_lock( &rx_lock );
+	if ( FT_OK != FT_Write( ftHandle, txbuf, size, &retLen ) ) {
+		pthread_mutex_unlock( &rx_lock );
+		return FALSE;
+	}
+	tx_sent += count;
+	pthread_mutex_unlock( &rx_lock );
+	
+	return TRUE;
+}
+
+// Pump the receive side until every frame written so far has been
+// answered and, when seq is not negative, a new F reply has arrived
+static BOOL waitForTxReplies( FT_HANDLE ftHandle, long seq, long timeout_us )
+{
+	long slice;
+	
+	pthread_mutex_lock( &rx_lock );
+	while ( 1 ) {
+		if ( !rx_thread_running ) {
+			parseRxRing();
+		}
+		
+		if ( tx_answered == tx_sent && ( seq < 0 || status_seq != (unsigned int)seq ) ) {
+			pthread_mutex_unlock( &rx_lock );
+			return TRUE;
+		}
+		if ( !rx_thread_running && fillRxRing( ftHandle ) ) {
+			continue;
+		}
+		if ( timeout_us <= 0 ) {
+			pthread_mutex_unlock( &rx_lock );
+			return FALSE;
+		}
+		
+		slice = RX_WAIT_SLICE_US < timeout_us ? RX_WAIT_SLICE_US : timeout_us;
+		timeout_us -= slice;
+		if ( rx_thread_running ) {
+			waitOnRxCond( slice );
+		}
+		else {
+			pthread_mutex_unlock( &rx_lock );
+			waitForRx( ftHandle, slice );
+			pthread_mutex_lock( &rx_lock );
+		}
+	}
+}
+
+// Ask the adapter for its status flags (CANSTATUS_*), -1 on timeout
+int readStatusFlags( FT_HANDLE ftHandle, long timeout_us )
+{
+	DWORD retLen;
+	unsigned int seq;
+	
+	if ( transport ) {
+		return 0;
+	}
+	
+	pthread_mutex_lock( &rx_lock );
+	seq = status_seq;
+	if ( FT_OK != FT_Write( ftHandle, "F\r", 2, &retLen ) ) {
+		pthread_mutex_unlock( &rx_lock );
+		return -1;
+	}
+	pthread_mutex_unlock( &rx_lock );
+	if ( !waitForTxReplies( ftHandle, seq, timeout_us ) ) {
+		return -1;
+	}
+	
+	return status_flags;
+}
+
+void setTxBurst( int frames )
+{
+	if ( frames < 1 ) {
+		frames = 1;
+	}
+	if ( frames > CANUSB_TX_BURST_MAX ) {
+		frames = CANUSB_TX_BURST_MAX;
+	}
+	tx_burst = frames;
+}
+
+int getTxBurst()
+{
+	return tx_burst;
+}
+
+// Send count frames with one FT_Write per burst. Each burst ends with an
+// F command so the replies to the burst and the adapter's FIFO status
+// come back together; the next burst goes out only when the transmit
+// FIFO has room. Returns FALSE if the adapter refused any frame.
+BOOL sendFrames( FT_HANDLE ftHandle, const CANMsg *msgs, int count )
+{
+	char txbuf[CANUSB_TX_BURST_MAX * ( SLCAN_MAX_RECORD + 1 ) + 2];
+	unsigned int refused = tx_refused;
+	unsigned int seq;
+	int sent = 0;
+	int burst;
+	int size;
+	int i;
+	DWORD retLen;
+	
+	if ( transport ) {
+		for ( i = 0; i < count; i++ ) {
+			if ( !transport->send( transport->context, &msgs[i] ) ) {
+				return FALSE;
+			}
+		}
+		return TRUE;
+	}
+	
+	while ( sent < count ) {
+		burst = count - sent;
+		if ( burst > tx_burst ) {
+			burst = tx_burst;
+		}
+		
+		size = 0;
+		for ( i = 0; i < burst; i++ ) {
+			size += slcanEncode( txbuf + size, &msgs[sent + i] );
+		}
+		txbuf[size++] = 'F';
+		txbuf[size++] = 0x0d;
+		
+		pthread_mutex_lock( &rx_lock );
+		seq = status_seq;
+		if ( FT_OK != FT_Write( ftHandle, txbuf, size, &retLen ) || (int)retLen != size ) {
+			pthread_mutex_unlock( &rx_lock );
+			return FALSE;
+		}
+		tx_sent += burst;
+		pthread_mutex_unlock( &rx_lock );
+		
+		if ( !waitForTxReplies( ftHandle, seq, TX_REPLY_TIMEOUT_US ) ) {
+			return FALSE;
+		}
+		if ( tx_refused != refused ) {
+			return FALSE;
+		}
+		
+		while ( status_flags & CANSTATUS_TRANSMIT_FIFO_FULL ) {
+			if ( readStatusFlags( ftHandle, TX_REPLY_TIMEOUT_US ) < 0 ) {
+				return FALSE;
+			}
+		}
+		
+		sent += burst;
+	}
+	
+	return TRUE;
+}
+
+FT_STATUS writeCommand( FT_HANDLE ftHandle, char *cmd, int cmd_size ) 
+{
+	FT_STATUS ret;
+	DWORD bytes_written = 0;
+	ret = FT_Write( ftHandle, cmd, cmd_size, &bytes_written);
+	return ret;
+}
+
+FT_STATUS readCommand( FT_HANDLE ftHandle, int length, char *cmd, int *cmd_size ) 
 {
 	FT_STATUS ret;
 	DWORD bytes_read;
@@ -474,9 +934,9 @@ FT_STATUS readCommand( FT_HANDLE ftHandle, int length, char *cmd, int *cmd_size
 	do 
 	{
 		ret = FT_GetQueueStatus( ftHandle, &rx_buf_count );
-		if ( (int) rx_buf_count < length )
+		if ( ( ret == FT_OK ) && ( (int) rx_buf_count < length ) )
 		{
-			//usleep(1000);
+			waitForRx( ftHandle, RX_WAIT_SLICE_US );
 		}
 	} 
 	while ( ( ret == FT_OK ) && ( (int) rx_buf_count < length ) );	
@@ -494,51 +954,626 @@ FT_STATUS readCommand( FT_HANDLE ftHandle, int length, char *cmd, int *cmd_size
 }
 
 
+// Move everything the driver has queued into the ring with as few
+// FT_Read calls as possible (two when the free space wraps)
+static BOOL fillRxRing( FT_HANDLE ftHandle )
+{
+	DWORD rx_buf_count;
+	DWORD bytes_read;
+	DWORD chunk;
+	unsigned int space;
+	unsigned int head;
+	
+	if ( FT_OK != FT_GetQueueStatus( ftHandle, &rx_buf_count ) || rx_buf_count == 0 ) {
+		return FALSE;
+	}
+	
+	space = RX_RING_SIZE - ( rx_head - rx_tail );
+	if ( rx_buf_count > space ) {
+		rx_buf_count = space;
+	}
+	
+	while ( rx_buf_count ) {
+		head = rx_head & RX_RING_MASK;
+		chunk = RX_RING_SIZE - head;
+		if ( chunk > rx_buf_count ) {
+			chunk = rx_buf_count;
+		}
+		
+		bytes_read = 0;
+		if ( FT_OK != FT_Read( ftHandle, &rx_ring[head], chunk, &bytes_read ) ) {
+			return FALSE;
+		}
+		if ( stats_enabled ) {
+			recordHistogram( &stats.read_size, bytes_read );
+		}
+		rx_head += bytes_read;
+		rx_buf_count -= chunk;
+		rx_arrival_us = timestamps_enabled ? nowUs() : 0;
+		
+		if ( bytes_read < chunk ) {
+			break;
+		}
+	}
+	
+	return TRUE;
+}
+
+// Copy the next complete record (without its CR) from the ring into line.
+// Returns the record length or -1 if no complete record is buffered.
+static int nextRecord( char *line )
+{
+	unsigned char c;
+	int len;
+	
+	while ( rx_tail != rx_head ) {
+		
+		// BELL is the adapter's error reply and has no CR
+		if ( rx_ring[rx_tail & RX_RING_MASK] == 0x07 ) {
+			if ( tx_answered != tx_sent ) {
+				tx_answered++;
+				tx_refused++;
+			}
+			rx_tail++;
+			continue;
+		}
+		
+		for ( len = 0; rx_tail + len != rx_head; len++ ) {
+			c = rx_ring[( rx_tail + len ) & RX_RING_MASK];
+			if ( c == 0x0d ) {
+				break;
+			}
+			if ( len < SLCAN_MAX_RECORD ) {
+				line[len] = c;
+			}
+		}
+		
+		if ( rx_tail + len == rx_head ) {
+			// Incomplete, drop it only if it can never become a valid record
+			if ( len > SLCAN_MAX_RECORD ) {
+				rx_tail += len;
+			}
+			return -1;
+		}
+		
+		rx_tail += len + 1;
+		if ( len > SLCAN_MAX_RECORD ) {
+			continue;
+		}
+		
+		line[len] = 0;
+		return len;
+	}
+	
+	return -1;
+}
+
+// Decode a t/T/r/R record. Transmit acknowledgements and F replies are
+// accounted for here; they and any other reply return FALSE.
+static BOOL decodeFrame( const char *line, int len, CANMsg *msg )
+{
+	unsigned long flags;
+	
+	switch ( line[0] ) {
+		case 'z':
+		case 'Z':
+			// Frame accepted for transmission
+			if ( tx_answered != tx_sent ) {
+				tx_answered++;
+			}
+			return FALSE;
+		case 'F':
+			if ( len == 3 && slcanHex( line + 1, 2, &flags ) == 0 ) {
+				status_flags = flags;
+				status_seq++;
+			}
+			return FALSE;
+		default:
+			return slcanDecode( line, len, msg ) == SLCAN_FRAME;
+	}
+}
+
+static RX_ID_QUEUE *findRxQueue( unsigned long id )
+{
+	int i;
+	
+	for ( i = 0; i < rx_id_queue_count; i++ ) {
+		if ( rx_id_queues[i].id == id ) {
+			return &rx_id_queues[i];
+		}
+	}
+	return NULL;
+}
+
+// Adapter time in us of a timestamp, wrapped at SLCAN_TIMESTAMP_WRAP ms,
+// taking the wrap nearest to what the host clock at host_us suggests
+static long long unwrapTimestamp( unsigned long timestamp, long long host_us )
+{
+	long long expected_ms;
+	long long wraps;
+	
+	if ( !clock_synced ) {
+		return (long long)timestamp * 1000;
+	}
+	expected_ms = ( host_us - clock_offset_us ) / 1000;
+	wraps = ( expected_ms - (long long)timestamp + SLCAN_TIMESTAMP_WRAP / 2 ) / SLCAN_TIMESTAMP_WRAP;
+	return ( (long long)timestamp + wraps * SLCAN_TIMESTAMP_WRAP ) * 1000;
+}
+
+// Compare the adapter's time for a frame with when the host read it. The
+// difference is the clock offset plus however long USB took; the least
+// of it seen lately counts as the offset, so the quickest delivery is
+// taken to be instant. Caller holds rx_lock.
+static void clockSample( const CANMsg *msg, long long host_us )
+{
+	long long offset = host_us - unwrapTimestamp( msg->timestamp, host_us );
+	
+	if ( !clock_synced || host_us >= clock_window_end ) {
+		clock_previous_min = clock_synced ? clock_window_min : offset;
+		clock_window_min = offset;
+		clock_window_end = host_us + CLOCK_WINDOW_US;
+	}
+	else if ( offset < clock_window_min ) {
+		clock_window_min = offset;
+	}
+	clock_offset_us = clock_window_min < clock_previous_min ? clock_window_min : clock_previous_min;
+	clock_synced = TRUE;
+	
+	if ( stats_enabled ) {
+		recordHistogram( &stats.usb_delay, (unsigned long)( offset - clock_offset_us ) );
+	}
+}
+
+// Sort a frame into the queue of its id, or the shared one. A full queue
+// loses the frame (the shared one its oldest frame) rather than holding
+// up every other id. Caller holds rx_lock.
+static void dispatchFrame( const CANMsg *msg )
+{
+	RX_ID_QUEUE *queue = findRxQueue( msg->id );
+	
+	if ( ( msg->flags & CANMSG_TIMESTAMP ) && rx_arrival_us != 0 ) {
+		clockSample( msg, rx_arrival_us );
+	}
+	
+	if ( queue ) {
+		if ( queue->head - queue->tail >= RX_ID_QUEUE_SIZE ) {
+			stats.dropped++;
+			return;
+		}
+		queue->frames[queue->head & RX_ID_QUEUE_MASK] = *msg;
+		RX_BARRIER();
+		queue->head++;
+		return;
+	}
+	
+	if ( ( rx_frame_head - rx_frame_tail ) >= RX_FRAME_QUEUE ) {
+		rx_frame_tail++;
+		stats.dropped++;
+	}
+	rx_frames[rx_frame_head & RX_FRAME_MASK] = *msg;
+	rx_frame_head++;
+}
+
+// Decode every complete record in the ring and dispatch the frames.
+// Caller holds rx_lock.
+static void parseRxRing( void )
+{
+	CANMsg msg;
+	char line[SLCAN_MAX_RECORD + 1];
+	int len;
+	
+	while ( ( len = nextRecord( line ) ) >= 0 ) {
+		memset( &msg, 0, sizeof( CANMsg ) );
+		if ( decodeFrame( line, len, &msg ) ) {
+			dispatchFrame( &msg );
+		}
+	}
+}
+
+// Receive and dispatch whatever is there when no receive thread does it.
+// Caller holds rx_lock.
+static void pumpRx( FT_HANDLE ftHandle )
+{
+	CANMsg msg;
+	
+	if ( transport ) {
+		memset( &msg, 0, sizeof( CANMsg ) );
+		rx_arrival_us = timestamps_enabled ? nowUs() : 0;
+		while ( transport->receive( transport->context, &msg ) ) {
+			dispatchFrame( &msg );
+			memset( &msg, 0, sizeof( CANMsg ) );
+		}
+		return;
+	}
+	
+	parseRxRing();
+	if ( fillRxRing( ftHandle ) ) {
+		parseRxRing();
+	}
+}
+
+// Sleep on rx_cond for at most timeout_us. Caller holds rx_lock.
+static void waitOnRxCond( long timeout_us )
+{
+	struct timeval now;
+	struct timespec deadline;
+	
+	gettimeofday( &now, NULL );
+	deadline.tv_sec = now.tv_sec + timeout_us / 1000000;
+	deadline.tv_nsec = ( now.tv_usec + timeout_us % 1000000 ) * 1000;
+	if ( deadline.tv_nsec >= 1000000000 ) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait( &rx_cond, &rx_lock, &deadline );
+}
+
+// Return the next received frame, reading from the driver only when no
+// decoded frame is waiting. Does not block.
 BOOL readFrame( FT_HANDLE ftHandle, CANMsg *msg )
 {	
-	char rx_buf[100];
-	int bytes_read;
+	BOOL found = FALSE;
+	
+	pthread_mutex_lock( &rx_lock );
+	
+	if ( !rx_thread_running && rx_frame_tail == rx_frame_head ) {
+		pumpRx( ftHandle );
+	}
+	
+	if ( rx_frame_tail != rx_frame_head ) {
+		if ( stats_enabled ) {
+			recordHistogram( &stats.queue_depth, rx_frame_head - rx_frame_tail );
+		}
+		*msg = rx_frames[rx_frame_tail & RX_FRAME_MASK];
+		rx_frame_tail++;
+		found = TRUE;
+	}
+	else {
+		memset( msg, 0, sizeof( CANMsg ) );
+	}
+	
+	pthread_mutex_unlock( &rx_lock );
+	return found;
+}
+
+// Wait until readFrame() has something to return or timeout_us passes
+BOOL waitForFrame( FT_HANDLE ftHandle, long timeout_us )
+{
+	BOOL ready;
+	
+	if ( transport ) {
+		return transport->wait( transport->context, timeout_us );
+	}
+	if ( !rx_thread_running ) {
+		return waitForRx( ftHandle, timeout_us );
+	}
+	
+	pthread_mutex_lock( &rx_lock );
+	if ( rx_frame_tail == rx_frame_head && timeout_us > 0 ) {
+		waitOnRxCond( timeout_us );
+	}
+	ready = ( rx_frame_tail != rx_frame_head );
+	pthread_mutex_unlock( &rx_lock );
+	
+	return ready;
+}
+
+// Give frames with this id a queue of their own, so they wait for
+// readFrameId() instead of being mixed with, and dropped along with,
+// the rest of the bus traffic
+BOOL openRxQueue( unsigned long id )
+{
+	RX_ID_QUEUE *queue;
+	
+	pthread_mutex_lock( &rx_lock );
+	if ( findRxQueue( id ) ) {
+		pthread_mutex_unlock( &rx_lock );
+		return TRUE;
+	}
+	if ( rx_id_queue_count >= RX_ID_QUEUES ) {
+		pthread_mutex_unlock( &rx_lock );
+		return FALSE;
+	}
+	
+	queue = &rx_id_queues[rx_id_queue_count];
+	queue->id = id;
+	queue->head = queue->tail = 0;
+	RX_BARRIER();
+	rx_id_queue_count++;
+	pthread_mutex_unlock( &rx_lock );
+	
+	return TRUE;
+}
+
+// Return the next received frame with this id. Ids without a queue of
+// their own are looked for in the shared queue, dropping other frames
+// on the way like readFrame() callers always did. Does not block.
+BOOL readFrameId( FT_HANDLE ftHandle, unsigned long id, CANMsg *msg )
+{
+	RX_ID_QUEUE *queue = findRxQueue( id );
+	unsigned int tail;
+	
+	if ( !queue ) {
+		while ( readFrame( ftHandle, msg ) ) {
+			if ( msg->id == id ) {
+				return TRUE;
+			}
+		}
+		return FALSE;
+	}
+	
+	if ( queue->tail == queue->head && !rx_thread_running ) {
+		pthread_mutex_lock( &rx_lock );
+		pumpRx( ftHandle );
+		pthread_mutex_unlock( &rx_lock );
+	}
+	
+	tail = queue->tail;
+	if ( tail == queue->head ) {
+		memset( msg, 0, sizeof( CANMsg ) );
+		return FALSE;
+	}
+	RX_BARRIER();
+	if ( stats_enabled ) {
+		recordHistogram( &stats.queue_depth, queue->head - tail );
+	}
+	*msg = queue->frames[tail & RX_ID_QUEUE_MASK];
+	RX_BARRIER();
+	queue->tail = tail + 1;
+	
+	return TRUE;
+}
+
+// Wait until readFrameId() has something to return or timeout_us passes
+BOOL waitForFrameId( FT_HANDLE ftHandle, unsigned long id, long timeout_us )
+{
+	RX_ID_QUEUE *queue = findRxQueue( id );
+	BOOL ready;
+	
+	if ( !queue || !rx_thread_running ) {
+		return waitForFrame( ftHandle, timeout_us );
+	}
+	
+	pthread_mutex_lock( &rx_lock );
+	if ( queue->tail == queue->head && timeout_us > 0 ) {
+		waitOnRxCond( timeout_us );
+	}
+	ready = ( queue->tail != queue->head );
+	pthread_mutex_unlock( &rx_lock );
+	
+	return ready;
+}
+
+// Throw away every frame received but not read yet, both from the shared
+// queue and from the id queues. Called by the reader, like readFrameId().
+void flushRx()
+{
+	int i;
+	
+	pthread_mutex_lock( &rx_lock );
+	rx_frame_tail = rx_frame_head;
+	for ( i = 0; i < rx_id_queue_count; i++ ) {
+		rx_id_queues[i].tail = rx_id_queues[i].head;
+	}
+	pthread_mutex_unlock( &rx_lock );
+}
+
+static void *rxThreadMain( void *arg )
+{
+	FT_HANDLE ftHandle = (FT_HANDLE)arg;
+	
+	while ( rx_thread_running ) {
+		waitForRx( ftHandle, RX_WAIT_SLICE_US );
+		
+		pthread_mutex_lock( &rx_lock );
+		if ( fillRxRing( ftHandle ) ) {
+			parseRxRing();
+			pthread_cond_broadcast( &rx_cond );
+		}
+		pthread_mutex_unlock( &rx_lock );
+	}
+	
+	return NULL;
+}
+
+// Hand all reading from the driver to a dedicated thread, so frames are
+// assembled while the caller is busy sending
+BOOL startRxThread( FT_HANDLE ftHandle )
+{
+	if ( rx_thread_running || transport ) {
+		return TRUE;
+	}
+	
+	rx_thread_running = TRUE;
+	if ( pthread_create( &rx_thread, NULL, rxThreadMain, (void *)ftHandle ) != 0 ) {
+		printf("Error: Failed to start receive thread\n");
+		rx_thread_running = FALSE;
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+void stopRxThread()
+{
+	if ( !rx_thread_running ) {
+		return;
+	}
+	
+	rx_thread_running = FALSE;
+	pthread_join( rx_thread, NULL );
+}
+
+// Have the driver signal rx_event whenever bytes arrive so that readers
+// can sleep in waitForRx() instead of spinning on FT_GetQueueStatus
+BOOL enableRxEvent( FT_HANDLE ftHandle )
+{
+	FT_STATUS status;
+	
+	if ( transport ) {
+		return TRUE;
+	}
+	if ( !rx_event_initialized ) {
+		pthread_mutex_init( &rx_event.eMutex, NULL );
+		pthread_cond_init( &rx_event.eCondVar, NULL );
+		rx_event_initialized = TRUE;
+	}
+	
+	if ( FT_OK != ( status = FT_SetEventNotification( ftHandle, FT_EVENT_RXCHAR, (PVOID)&rx_event ) ) ) {
+		printf("Error: Failed to set event notification. return code = %d\n", status );
+		rx_event_enabled = FALSE;
+		return FALSE;
+	}
+	
+	rx_event_enabled = TRUE;
+	return TRUE;
+}
+
+// Wait until the receive queue holds data or timeout_us has passed.
+// Returns TRUE if there is something to read.
+BOOL waitForRx( FT_HANDLE ftHandle, long timeout_us )
+{
 	DWORD rx_buf_count;
-	int data_offset;
+	long slice;
+	struct timeval now;
+	struct timespec deadline;
 	
-	memset( msg, 0, sizeof( CANMsg ) );
+	while ( 1 ) {
+		rx_buf_count = 0;
+		if ( FT_OK != FT_GetQueueStatus( ftHandle, &rx_buf_count ) ) {
+			return FALSE;
+		}
+		if ( rx_buf_count ) {
+			return TRUE;
+		}
+		if ( timeout_us <= 0 ) {
+			return FALSE;
+		}
+		
+		slice = ( timeout_us < RX_WAIT_SLICE_US ) ? timeout_us : RX_WAIT_SLICE_US;
+		timeout_us -= slice;
+		
+		if ( !rx_event_enabled ) {
+			// No event support from the driver, fall back to polling
+			usleep( slice );
+			continue;
+		}
+		
+		gettimeofday( &now, NULL );
+		deadline.tv_sec = now.tv_sec;
+		deadline.tv_nsec = ( now.tv_usec + slice ) * 1000;
+		if ( deadline.tv_nsec >= 1000000000 ) {
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+		}
+		
+		pthread_mutex_lock( &rx_event.eMutex );
+		pthread_cond_timedwait( &rx_event.eCondVar, &rx_event.eMutex, &deadline );
+		pthread_mutex_unlock( &rx_event.eMutex );
+	}
+}
+
+static int histogramIndex( unsigned long value )
+{
+	int shift = 0;
 	
-	FT_GetQueueStatus( ftHandle, &rx_buf_count );
-	if ( rx_buf_count == 0 )
-	{
-		//usleep(100);
-		//printf("rx_buf_count==0");
+	if ( value > 0xFFFFFFFFUL ) {
+		value = 0xFFFFFFFFUL;
+	}
+	while ( ( value >> shift ) >= 32 ) {
+		shift++;
 	}
 	
-	if ( readCommand ( ftHandle, 1, rx_buf, &bytes_read ) == FT_OK )
-	{
-		switch(rx_buf[0])
-		{
-			case 't':
-				if ( readCommand ( ftHandle, 21, rx_buf, &bytes_read ) == FT_OK )
-				{
-					msg->flags = 0;
-					sscanf( rx_buf, "%03x", &msg->id);
-					sscanf( &rx_buf[3], "%1x", &data_offset);
-					msg->len = rx_buf[3] - '0';
-					//printf("rx_buf %s", rx_buf);
-					//if ( readCommand ( ftHandle, data_offset*2+1, rx_buf, &bytes_read ) == FT_OK )
-					{
-						int data_byte;
-						for ( unsigned int i = 0; i < data_offset; i++ ) {
-							sscanf( &rx_buf[4+i*2], "%2x", &data_byte );
-							msg->data[i] = (char)data_byte;
-						}
-						//printf(">");
-						return TRUE;
-					}
-				}
-				break;
-			case 'T':
-			case 'r':
-			case 'R':
-				break;
+	return shift == 0 ? (int)value : 16 * shift + (int)( value >> shift );
+}
+
+// Highest value that falls into bucket index
+static unsigned long histogramValue( int index )
+{
+	int shift;
+	
+	if ( index < 32 ) {
+		return index;
+	}
+	shift = index / 16 - 1;
+	return ( (unsigned long)( index - 16 * shift + 1 ) << shift ) - 1;
+}
+
+void recordHistogram( CANUSB_HISTOGRAM *hist, unsigned long value )
+{
+	hist->bucket[histogramIndex( value )]++;
+	hist->count++;
+	hist->sum += value;
+	if ( value > hist->max ) {
+		hist->max = value;
+	}
+}
+
+// Value below which percentile % of the recorded values fall, to the
+// resolution of the buckets
+unsigned long histogramPercentile( const CANUSB_HISTOGRAM *hist, double percentile )
+{
+	unsigned long wanted;
+	unsigned long seen = 0;
+	unsigned long value;
+	int i;
+	
+	if ( hist->count == 0 ) {
+		return 0;
+	}
+	wanted = (unsigned long)( hist->count * percentile / 100.0 + 0.5 );
+	if ( wanted < 1 ) {
+		wanted = 1;
+	}
+	
+	for ( i = 0; i < CANUSB_HIST_BUCKETS; i++ ) {
+		seen += hist->bucket[i];
+		if ( seen >= wanted ) {
+			break;
 		}
 	}
-	return FALSE;
-}
\ No newline at end of file
+	
+	value = histogramValue( i );
+	return value < hist->max ? value : hist->max;
+}
+
+// Have the adapter stamp every frame it receives (Z1) from the next
+// openChannel() on
+void enableTimestamps( BOOL enable )
+{
+	timestamps_enabled = enable;
+}
+
+// How long ago the adapter received msg in us, going by its timestamp,
+// or -1 if it has none or there is nothing to compare it with yet. The
+// quickest delivery seen lately counts as instant.
+long long adapterAgeUs( const CANMsg *msg )
+{
+	long long now = nowUs();
+	long long age = -1;
+	
+	pthread_mutex_lock( &rx_lock );
+	if ( ( msg->flags & CANMSG_TIMESTAMP ) && clock_synced ) {
+		age = now - ( unwrapTimestamp( msg->timestamp, now ) + clock_offset_us );
+		if ( age < 0 ) {
+			age = 0;
+		}
+	}
+	pthread_mutex_unlock( &rx_lock );
+	return age;
+}
+
+void enableStats( BOOL enable )
+{
+	stats_enabled = enable;
+}
+
+CANUSB_STATS *getStats()
+{
+	return &stats;
+}
+
+void resetStats()
+{
+	memset( &stats, 0, sizeof( stats ) );
+}
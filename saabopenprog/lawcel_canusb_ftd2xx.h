@@ -7,7 +7,12 @@
  *
  */
 
+#ifndef LAWCEL_CANUSB_FTD2XX_H
+#define LAWCEL_CANUSB_FTD2XX_H
+
 #include "ftd2xx.h"
+#include "slcan.h"
+#include <pthread.h>
 
 #define BUF_SIZE 30
 
@@ -16,34 +21,128 @@
 
 #define CANHANDLE FT_HANDLE
 
-// Message flags
-#define CANMSG_EXTENDED   0x80 // Extended CAN id
-#define CANMSG_RTR        0x40 // Remote frame
+// Receive event, same layout as the EVENT_HANDLE that libftd2xx
+// signals from its read thread when FT_EVENT_RXCHAR is enabled
+typedef struct {
+	pthread_cond_t eCondVar;
+	pthread_mutex_t eMutex;
+	int iVar;
+} CANUSB_EVENT;
+
+// Status flags returned by the F command
+#define CANSTATUS_RECEIVE_FIFO_FULL		0x01
+#define CANSTATUS_TRANSMIT_FIFO_FULL	0x02
+#define CANSTATUS_ERROR_WARNING			0x04
+#define CANSTATUS_DATA_OVERRUN			0x08
+#define CANSTATUS_ERROR_PASSIVE			0x20
+#define CANSTATUS_ARBITRATION_LOST		0x40
+#define CANSTATUS_BUS_ERROR				0x80
+
+// Frames written per FT_Write by sendFrames()
+#define CANUSB_TX_BURST_DEFAULT	8
+#define CANUSB_TX_BURST_MAX		64
+
+// Frame level transport that stands in for the CANUSB adapter, e.g. a
+// simulated ECU. While one is installed with setTransport() the frame
+// functions below go to it and the adapter commands do nothing.
+typedef struct {
+	BOOL (*send)( void *context, const CANMsg *msg );
+	BOOL (*receive)( void *context, CANMsg *msg );
+	BOOL (*wait)( void *context, long timeout_us );
+	void *context;
+} CANUSB_TRANSPORT;
+
+// Log-linear histogram in the style of HdrHistogram: exact below 32,
+// above that 16 buckets per power of two (about 6 % resolution)
+#define CANUSB_HIST_BUCKETS		464
+
+typedef struct {
+	unsigned long count;
+	unsigned long max;
+	double sum;
+	unsigned long bucket[CANUSB_HIST_BUCKETS];
+} CANUSB_HISTOGRAM;
+
+// What the receive side saw while statistics were enabled
+typedef struct {
+	CANUSB_HISTOGRAM read_size;		// bytes per FT_Read
+	CANUSB_HISTOGRAM queue_depth;	// frames waiting when readFrame() returns one
+	CANUSB_HISTOGRAM usb_delay;		// us from the adapter's timestamp to FT_Read, above the quickest
+	unsigned long dropped;			// frames lost to a full receive queue
+} CANUSB_STATS;
+
+// A CANUSB found by listAdapters()
+typedef struct {
+	char serial[16];		// FTDI serial number, what openAdapter() takes
+	char description[64];
+	BOOL in_use;			// already opened by some process
+} CANUSB_ADAPTER;
 
-// CAN Frame
+// One step of an adapter command script, see runCommands()
 typedef struct {
-	unsigned long id;         // Message id
-	unsigned long timestamp;  // timestamp in milliseconds
-	unsigned char flags;      // [extended_id|1][RTR:1][reserver:6]
-	unsigned char len;        // Frame size (0.8)
-	unsigned char data[ 8 ];  // Databytes 0..7
-} CANMsg;
+	char command[BUF_SIZE];	// without the CR, e.g. "S6" or "M00000000"
+	BOOL may_fail;			// a BELL is not an error for this step
+	char reply[BUF_SIZE];	// text of the reply, e.g. the version for V
+} CANUSB_COMMAND;
 
 #define CANUSB_ACCEPTANCE_CODE_LIGHT	0xFF5FFF5F
 #define CANUSB_ACCEPTANCE_MASK_LIGHT	0xFF1FFF1F
 
+// Acceptance code and mask that let every frame through
+#define CANUSB_ACCEPT_ALL_CODE			0x00000000
+#define CANUSB_ACCEPT_ALL_MASK			0xFFFFFFFF
+
+// What probeBitrate() heard in listen-only mode
+#define CANUSB_PROBE_FAILED		-1		// the adapter refused the setup
+#define CANUSB_PROBE_SILENT		0		// neither frames nor errors
+#define CANUSB_PROBE_ERRORS		1		// bus errors, the wrong bitrate
+#define CANUSB_PROBE_TRAFFIC	2		// a good frame, the right bitrate
+
 #define ERROR_CANUSB_OK					1
 
 void initializeCanUsb();
+int listAdapters( CANUSB_ADAPTER *adapters, int max );
+FT_STATUS openAdapter( const char *serial, FT_HANDLE *pftHandle );
+BOOL setUsbTuning( FT_HANDLE ftHandle, unsigned int latency_ms, unsigned long transfer_size );
 void getVersionInfo(FT_HANDLE ftHandle);
 void getSerialNumber( FT_HANDLE ftHandle );
-void setCodeRegister(FT_HANDLE ftHandle);
-void setMaskRegister(FT_HANDLE ftHandle);
+void setCodeRegister( FT_HANDLE ftHandle, unsigned long code );
+void setMaskRegister( FT_HANDLE ftHandle, unsigned long mask );
+void computeAcceptanceFilter( const unsigned long *ids, int count, unsigned long *code, unsigned long *mask );
+BOOL setAcceptanceFilter( FT_HANDLE ftHandle, const unsigned long *ids, int count );
 void setTimeStampOn( FT_HANDLE ftHandle );
 BOOL openChannel( FT_HANDLE ftHandle, char* bitrate );
+int probeBitrate( FT_HANDLE ftHandle, const char *bitrate, long window_us );
+int detectBitrate( FT_HANDLE ftHandle, const char * const *bitrates, int count, long window_us );
+BOOL getAdapterSerial( FT_HANDLE ftHandle, char *serial, int size );
+int runCommands( FT_HANDLE ftHandle, CANUSB_COMMAND *steps, int count, long timeout_us );
 BOOL closeChannel( FT_HANDLE ftHandle );
 FT_STATUS setTimeouts( FT_HANDLE ftHandle, ULONG ReadTimeout, ULONG WriteTimeout);
 BOOL sendFrame( FT_HANDLE ftHandle, CANMsg *pmsg );
+BOOL sendFrames( FT_HANDLE ftHandle, const CANMsg *msgs, int count );
+BOOL queueFrames( FT_HANDLE ftHandle, const CANMsg *msgs, int count );
+void setTxBurst( int frames );
+int getTxBurst();
+int readStatusFlags( FT_HANDLE ftHandle, long timeout_us );
 FT_STATUS writeCommand( FT_HANDLE ftHandle, char *cmd, int cmd_size );
 FT_STATUS readCommand( FT_HANDLE ftHandle, int length, char *cmd, int *cmd_size );
-BOOL readFrame( FT_HANDLE ftHandle, CANMsg *msg );
\ No newline at end of file
+BOOL readFrame( FT_HANDLE ftHandle, CANMsg *msg );
+BOOL enableRxEvent( FT_HANDLE ftHandle );
+BOOL waitForRx( FT_HANDLE ftHandle, long timeout_us );
+BOOL waitForFrame( FT_HANDLE ftHandle, long timeout_us );
+BOOL openRxQueue( unsigned long id );
+BOOL readFrameId( FT_HANDLE ftHandle, unsigned long id, CANMsg *msg );
+BOOL waitForFrameId( FT_HANDLE ftHandle, unsigned long id, long timeout_us );
+void flushRx();
+BOOL startRxThread( FT_HANDLE ftHandle );
+void stopRxThread();
+void setTransport( const CANUSB_TRANSPORT *pTransport );
+void recordHistogram( CANUSB_HISTOGRAM *hist, unsigned long value );
+unsigned long histogramPercentile( const CANUSB_HISTOGRAM *hist, double percentile );
+void enableTimestamps( BOOL enable );
+long long adapterAgeUs( const CANMsg *msg );
+void enableStats( BOOL enable );
+CANUSB_STATS *getStats();
+void resetStats();
+
+#endif
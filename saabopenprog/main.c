@@ -11,7 +11,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 #include "lawcel_canusb_ftd2xx.h"
+#include "trionic7_sim.h"
+#include "image_file.h"
+#include "image_scan.h"
+#include "header_index.h"
+#include "catalog.h"
 
 #define RELEASE_VERSION "0.88"
 #define RELEASE_DATE    "2007-10-22"
@@ -20,16 +40,125 @@
 #define WRITE           0x02
 #define RAW_WRITE       0x04
 #define TIS_WRITE       0x08
+#define SKIP_ERASED     0x10
+#define DELTA           0x20
+#define BENCHMARK       0x40
 #define VERIFY          0x80
 
 #define ESC   27
 
-#define CANUSB_ACCEPTANCE_CODE_LIGHT	0xFF5FFF5F
-#define CANUSB_ACCEPTANCE_MASK_LIGHT	0xFF1FFF1F
+/* Adaptive pacing of the programming loops, see send_block() */
+#define PACE_GAP_MAX_US     3000    /* the fixed gap used before pacing */
+#define PACE_GAP_STEP_US    250
+#define PACE_RECOVER_BLOCKS 64      /* good blocks before speeding up again */
+#define PACE_RETRIES        4
+
+/* Bytes per read request. The answer's length byte also counts the two
+   non-payload bytes, so 0xFD is the most a single request can carry. */
+#define READ_BLOCK_DEFAULT  0xEF
+#define READ_BLOCK_MAX      0xFD
+
+/* Benchmark mode, see run_benchmark() */
+#define BENCH_HEADER_ROUNDS 8       /* sweeps over all header fields */
+#define BENCH_MAX_SAMPLES   16384   /* latency samples kept per phase */
+#define BENCH_PHASES        4
+
+/* Jobs run side by side on several adapters, see run_jobs() */
+#define MAX_JOBS            32
+#define JOB_MAX_ARGS        8
+#define JOB_REFRESH_MS      250
+
+/* How often the daemon looks for new jobs, see run_daemon() */
+#define SPOOL_POLL_MS       500
+
+/* Most processes reading binaries for the catalog, see build_catalog() */
+#define CATALOG_MAX_WORKERS 64
+
+/* Looking for the bus, see find_bus() */
+#define BUS_PROBE_US        250000  /* longest wait for traffic at one bitrate */
+
+/* Settings kept per adapter in $HOME, see load_setting() */
+#define BITRATE_FILE        ".saabopenprog_bitrates"    /* last bitrate that worked */
+#define USB_PROFILE_FILE    ".saabopenprog_usb"         /* from calibrate_usb() */
+#define SETTINGS_MAX_ADAPTERS 64
+
+/* USB latency timer (ms) and transfer size until calibrated, see tune_usb() */
+#define USB_LATENCY_DEFAULT     2
+#define USB_TRANSFER_DEFAULT    0x8000
+
+/* Sweep of calibrate_usb() */
+#define CALIBRATE_SETTINGS      20
+#define CALIBRATE_ROUNDS        200
+#define CALIBRATE_TIMEOUT_US    100000
+#define CALIBRATE_SLACK_PERCENT 10      /* p99 this close to the best counts as as good */
+
+/* Statistics per CAN id, see trace_sent() and dump_stats() */
+typedef struct {
+    int id;
+    long frames;
+    long retries;               /* failed sends, resent blocks and timeouts */
+    CANUSB_HISTOGRAM latency;   /* sent: until the response, received: since the last send */
+    CANUSB_HISTOGRAM to_bus;    /* part of it until the adapter stamped the response */
+    CANUSB_HISTOGRAM from_bus;  /* the rest, USB and the host */
+} ID_STATS;
+
+#define STATS_IDS           5
+
+/* Frames of one "Data Transfer" block, sent together by send_block() */
+typedef struct {
+    CANMsg msg[64];
+    int count;
+} TX_BLOCK;
+
+/* Counters of one benchmark phase */
+typedef struct {
+    const char *name;
+    int ok;
+    long long duration_us;
+    long bytes;
+    long frames_sent;
+    long frames_received;
+    int requests;                       /* 0x240 requests answered on 0x258 */
+    int latency_us[BENCH_MAX_SAMPLES];  /* request -> first response */
+} BENCH_PHASE;
+
+/* One line of a jobs file. Each job runs the usual single adapter
+   session in a worker process of its own, whose output is read back
+   through a pipe for the progress display. */
+typedef struct {
+    char line[256];                     /* the line, cut up into serial and args */
+    char *serial;                       /* adapter, "-" for the first one */
+    char *args[JOB_MAX_ARGS + 2];       /* as run_session() takes them */
+    int nargs;
+    int simulated;                      /* has the E option and needs no adapter */
+    pid_t pid;                          /* 0 until started, -1 when done */
+    int fd;                             /* read end of the worker's stdout */
+    char out[128];                      /* output not looked at yet */
+    int out_len;
+    float percent;
+    char status[48];                    /* last output that was not progress */
+    int result;
+} JOB;
+
+/* A Saab bus and the CANUSB command for its bitrate */
+typedef struct {
+    char *bitrate;
+    const char *name;
+} BUS;
+
+#define BUSES               2
+#define BUS_PBUS            1
+
+/* What calibrate_usb() measured for one setting */
+typedef struct {
+    unsigned int latency;               /* ms */
+    unsigned long transfer;             /* bytes */
+    unsigned long p50, p99;             /* round trip, us */
+    long cpu;                           /* us per round trip */
+} CALIBRATION;
 
 /* function prototypes */
-int load_file(const char *filename, unsigned char *data);
-int save_file(const char *filename, const unsigned char *data);
+int load_file(const char *filename, IMAGE *image);
 int send_msg( CANHANDLE handle, int id, const unsigned char *data );
 void ask_header( CANHANDLE handle, unsigned char header_id, unsigned char *answer);
 void ask_header2( CANHANDLE handle, unsigned char header_id, unsigned char *answer);
@@ -38,57 +167,189 @@ int authenticate( CANHANDLE handle );
 int erase_trionic( CANHANDLE handle );
 int program_trionic( CANHANDLE handle, unsigned char *bin, const char *vin, const char *swdate, const char *tester );
 int program_trionic_tis( CANHANDLE handle, unsigned char *bin, const char *vin, const char *swdate, const char *tester );
-int read_trionic( CANHANDLE handle, int addr, int len, unsigned char *bin);
+int read_trionic( CANHANDLE handle, int addr, int len, IMAGE *image);
 int verify_trionic( CANHANDLE handle, int addr, int len, const unsigned char *written);
 int write_data_block( CANHANDLE handle, unsigned char header_id, const unsigned char *block);
 unsigned short calc_auth_key( unsigned short seed, unsigned char method );
 int get_header_field_string(const unsigned char *bin, unsigned char id, unsigned char *answer);
 int strip_header_field(unsigned char *bin);
 int verify_binary( const unsigned char *written, const unsigned char *read );
+int parse_sim_option( char *arg );
+int run_session( int argc, char *argv[] );
+int parse_options( int argc, char *argv[] );
+int open_bus( FT_HANDLE *handle );
+int find_bus( FT_HANDLE h );
+void adapter_id( FT_HANDLE h, char *serial, int size );
+void settings_file( const char *name, char *path, int size );
+int load_setting( const char *name, const char *serial, char *value, int size );
+int save_setting( const char *name, const char *serial, const char *value );
+void tune_usb( FT_HANDLE h );
+long long cpu_time_us();
+int calibrate_usb( int argc, char *argv[] );
+void release_bus( FT_HANDLE h );
+void reset_session();
+int daemon_job_options( const JOB *job );
+int run_daemon( int argc, char *argv[] );
+void stop_daemon( int signal_number );
+int collect_images( const char *path, int named, char ***paths, int *n, int *max );
+int catalog_image( const char *path, CATALOG_ENTRY *entry );
+int build_catalog( int argc, char *argv[] );
+int find_catalog( int argc, char *argv[] );
+int confirm_programming();
+int list_adapters();
+int run_jobs( const char *filename, char *program );
+int parse_job( JOB *job, const char *line, char *program );
+void start_job( JOB *job );
+void job_output( JOB *job, const char *data, int len );
+void show_jobs( JOB *jobs, int n, int redraw );
+long long get_time_us();
+void bench_sent( const CANMsg *msgs, int count );
+void bench_received( const CANMsg *msg );
+void trace_sent( const CANMsg *msgs, int count );
+void trace_received( const CANMsg *msg );
+void trace_retry( int id );
+void dump_stats( const char *phase );
+int run_benchmark( CANHANDLE handle, const char *filename );
+void queue_frame( TX_BLOCK *block, int id, const unsigned char *data );
+int send_block( CANHANDLE handle, TX_BLOCK *block, unsigned char *data );
+void pace_backoff( const char *reason );
+void pace_success( void );
+int end_program_trionic( CANHANDLE handle, const char *vin, const char *swdate, const char *tester, int bin_count );
+int block_is_erased( const unsigned char *bin, int len );
+void queue_data_block( TX_BLOCK *block, const unsigned char *bin, int len );
+int program_skip_erased( CANHANDLE handle, const unsigned char *bin, int start, int end );
+void queue_read_request( TX_BLOCK *block, int address, int length );
+void read_block_size_refused( int requested );
 
 long gettickscount();
 
 /* global constants */
 const char init_msg[8]     = { 0x3F, 0x81, 0x00, 0x11, 0x02, 0x40, 0x00, 0x00 };
 
+/* Ids the adapter lets through, see setAcceptanceFilter() */
+const unsigned long init_ids[2]    = { 0x238, 0x258 };  /* initialization */
+const unsigned long session_ids[1] = { 0x258 };         /* everything after it */
+
 /* global variables */
-unsigned char binary[512*1024];         /* Store to whole 512 kB binary in RAM */
-unsigned char read_binary[512*1024];    /* Store to whole 512 kB binary in RAM */
+IMAGE write_image;                      /* the binary to write, see load_file() */
+IMAGE_SCAN write_scan;                  /* what load_file() found in it */
+HEADER_INDEX write_header;              /* its header fields */
+IMAGE read_image;                       /* what is read from the Trionic */
+unsigned char *binary = NULL;           /* write_image.data */
+unsigned char *read_binary = NULL;      /* read_image.data */
 FILE *log_output;
 int binary_length = 0;
+int pace_gap_us = 0;                    /* start with no gap at all */
+int pace_good_blocks = 0;
+int pace_backoffs = 0;
+int skip_erased = 0;                    /* leave out all 0xFF blocks when programming */
+int read_block_size = READ_BLOCK_MAX;   /* lowered if the Trionic refuses it */
+int simulate = 0;                       /* talk to the simulated Trionic, no CANUSB */
+const char *sim_image = NULL;
+T7SIM_CONFIG sim_config;
+BENCH_PHASE *bench_phase = NULL;        /* phase being measured, NULL when not benchmarking */
+long long bench_request_us = 0;         /* when the unanswered request was sent, 0 if none */
+int instrument = 0;                     /* gather statistics for dump_stats() */
+int daemon_instrument = 0;              /* the daemon's own I option, the default of every job */
+ID_STATS id_stats[STATS_IDS] = {
+    { 0x220, 0, 0, { 0 }, { 0 }, { 0 } },
+    { 0x238, 0, 0, { 0 }, { 0 }, { 0 } },
+    { 0x240, 0, 0, { 0 }, { 0 }, { 0 } },
+    { 0x258, 0, 0, { 0 }, { 0 }, { 0 } },
+    { 0x266, 0, 0, { 0 }, { 0 }, { 0 } }
+};
+ID_STATS *stats_sent_id = NULL;         /* last frame sent and when */
+long long stats_sent_us = 0;
+const char *adapter_serial = NULL;      /* CANUSB to open, NULL for the first one */
+int confirmed = 0;                      /* programming already confirmed, for workers */
+int bus_open = 0;                       /* bus_handle stays open between sessions */
+FT_HANDLE bus_handle = NULL;
+BUS buses[BUSES] = {
+    { "scb9a", "Saab I-Bus (47,619 kBit/s)" },
+    { "S6",    "Saab P-Bus (500 kBit/s)" }
+};
+volatile sig_atomic_t daemon_stop = 0;
 
 
 int main(int argc, char *argv[])
+{
+    initT7SimConfig( &sim_config );
+    if( argc == 2 && ( *argv[1] == 'L' || *argv[1] == 'l' ) )
+        return list_adapters();
+    if( argc == 3 && ( *argv[1] == 'J' || *argv[1] == 'j' ) )
+        return run_jobs( argv[2], argv[0] );
+
+    if( argc >= 3 && ( *argv[1] == 'Q' || *argv[1] == 'q' ) )
+        return run_daemon( argc, argv );
+    if( argc >= 4 && ( *argv[1] == 'X' || *argv[1] == 'x' ) )
+        return build_catalog( argc, argv );
+    if( argc >= 3 && ( *argv[1] == 'F' || *argv[1] == 'f' ) )
+        return find_catalog( argc, argv );
+    if( argc >= 2 && ( *argv[1] == 'C' || *argv[1] == 'c' ) )
+        return calibrate_usb( argc, argv );
+
+    return run_session( argc, argv );
+}
+
+/* Everything from opening the adapter to closing it again, for the
+   operation and file given on the command line */
+int run_session( int argc, char *argv[] )
 {
     //CANHANDLE h;
 	FT_HANDLE h = NULL;
     CANMsg msg;
-	UCHAR pucLatency;
-    FILE *bin;
     int ch, ret, i, k, j;
+    int result = 0;
     //int timestamp, last_timestamp;
     unsigned char data[8], buf[256], vin[18], swdate[7], tester[14], immo[16];
+    char identity[IMAGE_IDENTITY_SIZE] = "";     /* VIN and SW part number, see resumeImage() */
     LPTSTR verinfo;
     unsigned short seed, key;
-    DWORD dwStart, dwLength;
+    long long start_us, elapsed_us;
     //HANDLE hout = GetStdHandle(STD_OUTPUT_HANDLE);
     char operation;
-	FT_STATUS ftStatus;
     
     //SetConsoleTitle("SaabOpenProg v" RELEASE_VERSION );
 
     printf("SaabOpenProg v%s - Read/Program Saab Trionic 7 ECU with Lawicel CANUSB\n"
            "by Tomi Liljemark %s\n\n", RELEASE_VERSION, RELEASE_DATE);
 
+    reset_session();
 
     if( argc < 3 )
     {
-        printf("Usage: SaabOpenProg <R|W|A> [V] <filename.bin>\n\n"
+        printf("Usage: SaabOpenProg <R|W|A|T|B> [V|S|D|E|I|U] <filename.bin>\n"
+               "       SaabOpenProg L\n"
+               "       SaabOpenProg J <jobs.txt>\n"
+               "       SaabOpenProg Q [E|I|U] <spool directory>\n"
+               "       SaabOpenProg X <catalog> <directory|file.bin>...\n"
+               "       SaabOpenProg F <catalog> [field=value]...\n"
+               "       SaabOpenProg C [U]\n\n"
                "Where R = Read from Trionic to PC\n"
                "      W = Write from PC to Trionic\n"
                "      A = Raw write from PC to Trionic\n"
                "      T = Write \"TIS\" binary from PC to Trionic\n"
-               "      V = Verify written data (not implemented yet!)\n");
+               "      B = Benchmark header queries, read, erase and writing back what\n"
+               "          was read; results go to filename as JSON\n"
+               "      V = Verify written data (not implemented yet!)\n"
+               "      S = Skip blocks that are all 0xFF when writing\n"
+               "      D = Read the Trionic first, write only if it differs (implies S)\n"
+               "      E = Use a simulated Trionic instead of the CANUSB, settings as\n"
+               "          E,image=file.bin,bitrate=500000,latency=500,erase=2000,block=253\n"
+               "          (bit/s, us, ms, largest read; all optional)\n"
+               "      I = Log latency and receive statistics per CAN id\n"
+               "      U = Use the CANUSB with this serial number, as U,A1B2C3D4\n"
+               "      L = List the CANUSB adapters and their serial numbers\n"
+               "      J = Run the jobs in jobs.txt, each adapter in parallel; one job\n"
+               "          per line as: <serial|-> <R|W|A|T|B> [options] <filename.bin>\n"
+               "      Q = Keep the CANUSB open and run each *.job file dropped into the\n"
+               "          spool directory, one job line as in J; renamed to .ok/.failed\n"
+               "      X = Catalog the header fields of every .bin under the directories,\n"
+               "          reading only what changed since the catalog was last built\n"
+               "      F = Find binaries in a catalog by vin, hw, sw, version, engine,\n"
+               "          tester or date, as sw=5382212 or vin=YS3EF*\n"
+               "      C = Calibrate the USB latency timer and transfer size of the CANUSB;\n"
+               "          the best is kept for its serial number and used from then on\n");
         return -1;
     }
 
@@ -100,6 +361,8 @@ int main(int argc, char *argv[])
         operation = WRITE | TIS_WRITE;
     else if( *argv[1] == 'R' || *argv[1] == 'r' )
         operation = READ;
+    else if( *argv[1] == 'B' || *argv[1] == 'b' )
+        operation = BENCHMARK;
     
     // Change the extension of the filename to .log
     // and open file for writing debug info
@@ -123,14 +386,37 @@ int main(int argc, char *argv[])
     fprintf( log_output, "SaabOpenProg v%s - Read/Program Saab Trionic 7 ECU with Lawicel CANUSB\n"
                          "by Tomi Liljemark %s\n\n", RELEASE_VERSION, RELEASE_DATE);
 
+    if( parse_options( argc, argv ) != 0 )
+    {
+        fclose(log_output);
+        return -1;
+    }
+
 
     if( operation & WRITE )    
     {
-        if ( argc > 3 )
+        for( k = 2; k < argc - 1; k++ )
+        {
+            if( *argv[k] == 'V' || *argv[k] == 'v' ) operation |= VERIFY;
+            else if( *argv[k] == 'S' || *argv[k] == 's' ) operation |= SKIP_ERASED;
+            else if( *argv[k] == 'D' || *argv[k] == 'd' ) operation |= DELTA | SKIP_ERASED;
+        }
+        if( ( operation & SKIP_ERASED ) && ( operation & TIS_WRITE ) )
         {
-            if( *argv[2] == 'V' || *argv[2] == 'v' ) operation |= VERIFY;
+            printf("Note: skipping erased blocks is not supported for \"TIS\" binaries.\n");
+            fprintf( log_output, "Note: skipping erased blocks is not supported for \"TIS\" binaries.\n");
+            operation &= ~( DELTA | SKIP_ERASED );
         }
-        if( load_file( argv[argc-1], binary ) )
+        skip_erased = ( operation & SKIP_ERASED ) ? 1 : 0;
+        if( ( operation & DELTA ) && allocImage( &read_image ) != 0 )
+        {
+            printf("Error: out of memory!\n");
+            fprintf( log_output, "Error: out of memory!\n");
+            fclose(log_output);
+            return -1;
+        }
+        read_binary = read_image.data;
+        if( load_file( argv[argc-1], &write_image ) )
         {
             printf("Error: could not load file %s!\n", argv[argc-1]);
             fprintf( log_output, "Error: could not load file %s!\n", argv[argc-1]);
@@ -139,7 +425,7 @@ int main(int argc, char *argv[])
         }
 
         // Check that the file begins with FF FF EF FC
-        if( binary[0] != 0xFF || binary[1] != 0xFF || binary[2] != 0xEF || binary[3] != 0xFC )
+        if( !write_scan.signature )
         {
             printf("Error: binary doesn't appear to be for a Trionic 7 ECU! (%02X%02X%02X%02X)\n", 
                 binary[0], binary[1], binary[2], binary[3] );
@@ -219,18 +505,27 @@ int main(int argc, char *argv[])
     }
     else if( operation & READ )
     {
-        bin = fopen( argv[argc-1], "wb" );
-        if( bin == NULL )
+        // The dump goes into the file as it is read
+        if( createImage( &read_image, argv[argc-1] ) != 0 )
         {
             printf("Error: could not open file %s!\n", argv[argc-1]);
             fprintf( log_output, "Error: could not open file %s!\n", argv[argc-1]);
             fclose(log_output);
             return -1;
         }
-        else
+        read_binary = read_image.data;
+    }
+    else if( operation & BENCHMARK )
+    {
+        // The results file is written when the benchmark is done
+        if( allocImage( &read_image ) != 0 )
         {
-            fclose(bin);
+            printf("Error: out of memory!\n");
+            fprintf( log_output, "Error: out of memory!\n");
+            fclose(log_output);
+            return -1;
         }
+        read_binary = read_image.data;
     }
     else
     {
@@ -244,110 +539,24 @@ int main(int argc, char *argv[])
     }
     
 
-	initializeCanUsb();
-
-    printf("Opening CAN channel to Saab I-Bus (47,619 kBit/s)...");
-    fprintf( log_output, "Opening CAN channel to Saab I-Bus (47,619 kBit/s)...");
-    // Open CAN Channel
-    //if ( 0 >= ( h = canusb_Open( NULL,
-    //                            "0xcb:0x9a",
-    //                            CANUSB_ACCEPTANCE_CODE_LIGHT,
-    //                            CANUSB_ACCEPTANCE_MASK_LIGHT,
-    //                            CANUSB_FLAG_TIMESTAMP ) ) ) {
-	ftStatus = FT_OpenEx( "CANUSB", FT_OPEN_BY_DESCRIPTION, &h);
-	if(ftStatus != FT_OK) {
-		printf("FT_OpenEx() failed. rv=%d\n", ftStatus);
-		printf("Failed to open device\n");
-        fprintf( log_output, "Failed to open device\n");
-        fclose(log_output);
-		return -1;
-	}
-	
-	FT_ResetDevice(&h);
-	FT_Purge(&h, 3); // rx+tx
-	
-	
-	setTimeouts( h, 0x20, 0x40 );       //  read + write timeouts 0x80 0x17A
-	FT_SetUSBParameters(&h, 0x8000, 0);
-	
-	FT_GetLatencyTimer(&h, &pucLatency); //25 ms
-	printf("getlatency=%u\n",pucLatency);
-	pucLatency=2;
-	FT_SetLatencyTimer(&h, pucLatency);
-	FT_GetLatencyTimer(&h, &pucLatency); //25 ms
-	printf("getlatency=%u\n",pucLatency);
-	//setTimeStampOn(h);
-	setCodeRegister(h);
-	setMaskRegister(h);
-	
-	//bitrates:
-	//  "scb9a" == (47,619kBits/s (0xcb:0x9a)
-	//"S6" == 500kbit/s
-	if ( !openChannel( h, "S6\r" ) ) { //scb9a\r
-		printf("Failed to open channel\n");
-		return FALSE;
-	}
-	printf("OK channel open\n");
-  
-    printf("ok\n");
-    fprintf( log_output, "ok\n");
-    
-
-    if( wait_for_msg( h, 0, 250, data ) != 0 )
+    if( bus_open )
     {
-        printf("Message received from bus, everything seems OK.\n");
-        fprintf( log_output, "Message received from bus, everything seems OK.\n");
+        // The daemon keeps the channel open between jobs
+        h = bus_handle;
+        flushRx();
     }
-    else
+    else if( open_bus( &h ) != 0 )
     {
-        // Flush data CAN channel
-        //canusb_Flush( h, FLUSH_WAIT );
-		FT_Purge(h, FT_PURGE_RX | FT_PURGE_TX);
-        
-        // Close CAN channel
-        closeChannel( h );
-
-        printf("Opening CAN channel to Saab P-Bus (500 kBit/s)...");
-        fprintf( log_output, "Opening CAN channel to Saab P-Bus (500 kBit/s)...");
-        // Open CAN Channel
-        //if ( 0 >= ( h = canusb_Open( NULL,
-        //                            "500",
-        //                            CANUSB_ACCEPTANCE_CODE_LIGHT,
-        //                            CANUSB_ACCEPTANCE_MASK_LIGHT,
-        //                            CANUSB_FLAG_TIMESTAMP ) ) ) {
-		//"S6" == 500kbit/s
-		if ( !openChannel( h, "S6\r" ) ) {
-			printf("Failed to open device\n");
-            fprintf( log_output, "Failed to open device\n");
-            fclose(log_output);
-            return -1;
-        }
-        printf("ok\n");
-        fprintf( log_output, "ok\n");
-
-        if( wait_for_msg( h, 0, 250, data ) != 0 )
-        {
-            printf("Message received from bus, everything seems OK.\n");
-            fprintf( log_output, "Message received from bus, everything seems OK.\n");
-        }
-        else
-        {
-            printf("Error: could not receive any messages from either I-Bus or P-Bus!\n");
-            fprintf( log_output, "Error: could not receive any messages from either I-Bus or P-Bus!\n");
-            
-            // Flush data CAN channel
-            //canusb_Flush( h, FLUSH_WAIT );
-			FT_Purge(h, FT_PURGE_RX | FT_PURGE_TX);
-            
-            // Close CAN channel
-            closeChannel( h );
-            printf("\nCAN channel closed.\n");
-            fprintf( log_output, "\nCAN channel closed.\n");
-            fclose(log_output);
-            return -1;
-        }
+        fclose(log_output);
+        return -1;
     }
 
+    // Leave the rest of the bus traffic in the adapter
+    if( !setAcceptanceFilter( h, init_ids, 2 ) )
+    {
+        printf("Warning: could not set the acceptance filter\n");
+        fprintf( log_output, "Warning: could not set the acceptance filter\n");
+    }
 
     // Acquire Trionic information
     printf("Initialization...");
@@ -369,6 +578,9 @@ int main(int argc, char *argv[])
             printf("failed\n");
             fprintf( log_output, "failed\n");
         }
+
+        // Only 0x258 answers from here on
+        setAcceptanceFilter( h, session_ids, 1 );
         
         printf("\nInformation requested from the Trionic\n"
                  "--------------------------------------\n");
@@ -381,6 +593,7 @@ int main(int argc, char *argv[])
         {
             printf("VIN                  : %s\n", buf);
             fprintf( log_output, "VIN                  : %s\n", buf);
+            snprintf( identity, sizeof(identity), "%.24s", buf );
         }
         if( operation & TIS_WRITE ) strncpy( vin, buf, sizeof(vin) );
 
@@ -398,6 +611,7 @@ int main(int argc, char *argv[])
         {
             printf("Box SW part number   : %s\n", buf);
             fprintf( log_output, "Box SW part number   : %s\n", buf);
+            snprintf( identity + strlen( identity ), sizeof(identity) - strlen( identity ), " %.24s", buf );
         }
     
         buf[0] = 0x00;
@@ -450,23 +664,30 @@ int main(int argc, char *argv[])
         
     }
 
-    if( operation & WRITE )
+    // A journal left by a dump of another Trionic must not be resumed
+    if( operation & READ )
+    {
+        if( resumeImage( &read_image, identity ) != 0 )
+        {
+            printf("Warning: could not start the journal %s\n", read_image.journal_name);
+            fprintf( log_output, "Warning: could not start the journal %s\n", read_image.journal_name);
+        }
+        else if( read_image.kept > 0 )
+        {
+            printf("Resuming, 0x%05lX bytes already read.\n", read_image.kept);
+            fprintf( log_output, "Resuming, 0x%05lX bytes already read.\n", read_image.kept);
+        }
+    }
+
+    // The benchmark erases and rewrites the flash too, unless it is simulated
+    if( ( operation & WRITE ) || ( ( operation & BENCHMARK ) && !simulate ) )
     {
         // Lets use our own tester text... remove this to use the one in the binary
         // In case user wants Raw write, respect the one in the binary...
         if( !(operation & RAW_WRITE) ) strncpy( tester, "SAAB_OPEN_PRG", 13 );
     
         // Confirm that the user really wants to program
-        dwStart = time(NULL); //time(NULL);
-        printf(/*"Ensure that the VIN shown above is the correct one!\n\n"*/
-               "Note! If programming fails, you will probably have to re-program it using the\n"
-               "BDM interface. This means getting the right hardware, opening the Trionic box,\n"
-               "soldering a pin header to the circuit board and using special software.\n\n");
-    
-        printf("Are you SURE you want to program [y/N] ? ");
-        buf[0] = (unsigned char)getchar();
-        printf("\n");    
-        if( buf[0] != 'y' && buf[0] != 'Y' )
+        if( !confirmed && !confirm_programming() )
         {
             printf("Aborted, nothing done.\n");
             fprintf( log_output, "Aborted, nothing done.\n");
@@ -492,39 +713,69 @@ int main(int argc, char *argv[])
         //canusb_Flush( h, FLUSH_WAIT );
 		FT_Purge(h, FT_PURGE_RX | FT_PURGE_TX);
         
+        dump_stats( NULL );
         // Close CAN channel
-        closeChannel( h );
-        printf("\nCAN channel closed.\n");
-        fprintf( log_output, "\nCAN channel closed.\n");
+        release_bus( h );
         fclose(log_output);
         return -1;
     }
 
+    if( operation & BENCHMARK )
+    {
+        i = run_benchmark( h, argv[argc-1] );
+
+        FT_Purge(h, FT_PURGE_RX | FT_PURGE_TX);
+        dump_stats( NULL );
+        release_bus( h );
+        fclose(log_output);
+        return i;
+    }
+
+    if( operation & DELTA )
+    {
+        // Compare with what the Trionic already holds, the flash can only
+        // be erased as a whole so any difference means a full reprogram
+        printf("Reading Trionic for comparison...");
+        fprintf( log_output, "Reading Trionic for comparison...");
+        if( read_trionic( h, 0x0, 0x80000, &read_image ) == 0x80000 &&
+            memcmp( binary, read_binary, 0x7B000 ) == 0 &&
+            ( !(operation & RAW_WRITE) || memcmp( binary + 0x7FF00, read_binary + 0x7FF00, 0x100 ) == 0 ) )
+        {
+            printf(" - flash already matches the binary, nothing to write.\n");
+            fprintf( log_output, " - flash already matches the binary, nothing to write.\n");
+            operation &= ~WRITE;
+        }
+        else
+        {
+            printf(" - differs, writing.\n");
+            fprintf( log_output, " - differs, writing.\n");
+        }
+    }
+
     if( operation & WRITE )
     {
         // Erase
         printf("Erase...");
         fprintf( log_output, "Erase...");
-        dwStart = time(NULL);//time(NULL);
+        start_us = get_time_us();
         if( erase_trionic( h ) == 0 )
         {
-            dwLength = time(NULL) - dwStart; //time(NULL);
-            printf("ok (%3.1f s)\n", (float)dwLength/1000.0);
-            fprintf( log_output, "ok (%3.1f s)\n", (float)dwLength/1000.0);
+            elapsed_us = get_time_us() - start_us;
+            printf("ok (%3.1f s)\n", (float)elapsed_us/1000000.0);
+            fprintf( log_output, "ok (%3.1f s)\n", (float)elapsed_us/1000000.0);
         }
         else
         {
-            dwLength = time(NULL) - dwStart;
-            printf("failed (%3.1f s)\n", (float)dwLength/1000.0);
-            fprintf( log_output, "failed (%3.1f s)\n", (float)dwLength/1000.0);
+            elapsed_us = get_time_us() - start_us;
+            printf("failed (%3.1f s)\n", (float)elapsed_us/1000000.0);
+            fprintf( log_output, "failed (%3.1f s)\n", (float)elapsed_us/1000000.0);
             // Flush data CAN channel
             //canusb_Flush( h, FLUSH_WAIT );
 			FT_Purge(h, FT_PURGE_RX | FT_PURGE_TX);
             
+            dump_stats( NULL );
             // Close CAN channel
-            closeChannel( h );
-            printf("\nCAN channel closed.\n");
-            fprintf( log_output, "\nCAN channel closed.\n");
+            release_bus( h );
             fclose(log_output);
             return -1;
         }
@@ -535,44 +786,46 @@ int main(int argc, char *argv[])
         {
             printf("Programming (Raw mode)...");
             fprintf( log_output, "Programming (Raw mode)...");
-            dwStart = time(NULL);
+            start_us = get_time_us();
             i = program_trionic( h, binary, NULL, NULL, NULL );
         }
         else if( operation & TIS_WRITE )
         {
             printf("Programming (TIS mode)...");
             fprintf( log_output, "Programming (TIS mode)...");
-            dwStart = time(NULL);
+            start_us = get_time_us();
             i = program_trionic_tis( h, binary, vin, swdate, tester );
         }
         else
         {
             printf("Programming...");
             fprintf( log_output, "Programming...");
-            dwStart = time(NULL);
+            start_us = get_time_us();
             i = program_trionic( h, binary, vin, swdate, tester );
         }
 
+        fprintf( log_output, "\nPacing: settled on bursts of %d frames, %d us gap (%d back-offs)\n",
+                 getTxBurst(), pace_gap_us, pace_backoffs );
+
         // Was the programming a success?
         if( i == 0 )
         {
-            dwLength = time(NULL) - dwStart;
-            printf(" - ok (%4.1f min)\n", (float)dwLength/60000.0);
-            fprintf( log_output, " - ok (%4.1f min)\n", (float)dwLength/60000.0);
+            elapsed_us = get_time_us() - start_us;
+            printf(" - ok (%4.1f min)\n", (float)elapsed_us/60000000.0);
+            fprintf( log_output, " - ok (%4.1f min)\n", (float)elapsed_us/60000000.0);
         }
         else
         {
-            dwLength = time(NULL) - dwStart;
-            printf(" - failed (%4.1f min)\n", (float)dwLength/60000.0);
-            fprintf( log_output, " - failed (%4.1f min)\n", (float)dwLength/60000.0);
+            elapsed_us = get_time_us() - start_us;
+            printf(" - failed (%4.1f min)\n", (float)elapsed_us/60000000.0);
+            fprintf( log_output, " - failed (%4.1f min)\n", (float)elapsed_us/60000000.0);
             // Flush data CAN channel
             //canusb_Flush( h, FLUSH_WAIT );
 			FT_Purge(h, FT_PURGE_RX | FT_PURGE_TX);
             
+            dump_stats( NULL );
             // Close CAN channel
-            closeChannel( h );
-            printf("\nCAN channel closed.\n");
-            fprintf( log_output, "\nCAN channel closed.\n");
+            release_bus( h );
             fclose(log_output);
             return -1;
         }
@@ -583,25 +836,32 @@ int main(int argc, char *argv[])
         // Read
         printf("Reading..." );
         fprintf( log_output, "Reading..." );
-        dwStart = time(NULL);
-        i = read_trionic( h, 0x0, 0x80000, read_binary );
-        dwLength = time(NULL) - dwStart;
+        start_us = get_time_us();
+        i = read_trionic( h, 0x0, 0x80000, &read_image );
+        elapsed_us = get_time_us() - start_us;
     
         if( i == 0x80000 )
         {
-            printf(" - ok (%4.1f min)\n", (float)dwLength/60000.0);
-            fprintf( log_output, " - ok (%4.1f min)\n", (float)dwLength/60000.0);
+            printf(" - ok (%4.1f min)\n", (float)elapsed_us/60000000.0);
+            fprintf( log_output, " - ok (%4.1f min)\n", (float)elapsed_us/60000000.0);
         }
         else
         {
-            printf(" - failed (%4.1f min)\n", (float)dwLength/60000.0);
-            fprintf( log_output, " - failed (%4.1f min)\n", (float)dwLength/60000.0);
+            printf(" - failed (%4.1f min)\n", (float)elapsed_us/60000000.0);
+            fprintf( log_output, " - failed (%4.1f min)\n", (float)elapsed_us/60000000.0);
+            result = -1;
         }
     
-        if( save_file( argv[argc-1], read_binary ) != 0 )
+        if( finishImage( &read_image, i == 0x80000 ) != 0 )
         {
             printf("Error: write failed!\n");
             fprintf( log_output, "Error: write failed!\n");
+            result = -1;
+        }
+        else if( i != 0x80000 )
+        {
+            printf("Note: what was read is kept in %s, run again to read the rest.\n", read_image.journal_name);
+            fprintf( log_output, "Note: what was read is kept in %s, run again to read the rest.\n", read_image.journal_name);
         }
     }
     /* NOT READY YET...
@@ -609,17 +869,17 @@ int main(int argc, char *argv[])
     {
         // Verify-after-write
         printf("Verifying...");
-        dwStart = GetTickCount();
+        start_us = get_time_us();
         i = verify_trionic( h, 0x0, 0x80000, binary );
-        dwLength = GetTickCount() - dwStart;
+        elapsed_us = get_time_us() - start_us;
     
         if( i == 0 )
         {
-            printf(" - ok (%4.1f min)\n", (float)dwLength/60000.0);
+            printf(" - ok (%4.1f min)\n", (float)elapsed_us/60000000.0);
         }
         else
         {
-            printf(" - failed (%4.1f min)\n", (float)dwLength/60000.0);
+            printf(" - failed (%4.1f min)\n", (float)elapsed_us/60000000.0);
         }
     }
     */
@@ -628,141 +888,536 @@ int main(int argc, char *argv[])
     //canusb_Flush( h, FLUSH_WAIT );
 	FT_Purge(h, FT_PURGE_RX | FT_PURGE_TX);
     
+    dump_stats( NULL );
     // Close CAN channel
-    closeChannel( h );
-    printf("\nCAN channel closed.\n");
-    fprintf( log_output, "\nCAN channel closed.\n");
+    release_bus( h );
 
     fclose(log_output);
+    return result;
+}
+
+/* The options shared by a session and the daemon: E, I and U */
+int parse_options( int argc, char *argv[] )
+{
+    int k;
+
+    for( k = 2; k < argc - 1; k++ )
+    {
+        if( *argv[k] == 'E' || *argv[k] == 'e' )
+        {
+            simulate = 1;
+            if( parse_sim_option( argv[k] ) != 0 )
+            {
+                printf("Error: bad simulator setting in %s\n", argv[k]);
+                fprintf( log_output, "Error: bad simulator setting in %s\n", argv[k]);
+                return -1;
+            }
+        }
+        else if( *argv[k] == 'I' || *argv[k] == 'i' )
+        {
+            instrument = 1;
+            enableStats( TRUE );
+        }
+        else if( *argv[k] == 'U' || *argv[k] == 'u' )
+        {
+            if( argv[k][1] != ',' || argv[k][2] == 0 )
+            {
+                printf("Error: no serial number in %s\n", argv[k]);
+                fprintf( log_output, "Error: no serial number in %s\n", argv[k]);
+                return -1;
+            }
+            adapter_serial = argv[k] + 2;
+        }
+    }
     return 0;
 }
 
-int load_file(const char *filename, unsigned char *data)
+/* Open the adapter, or start the simulator, and find the bus the Trionic
+   is on. The receive thread runs when this returns 0. */
+int open_bus( FT_HANDLE *handle )
 {
-    FILE *bin;
-    int i;
-    size_t read_bytes;
-    unsigned char temp;
+    FT_HANDLE h = NULL;
+    FT_STATUS ftStatus;
+    int bus;
 
-    read_bytes = 0;
-    bin = fopen( filename, "rb" );
+	initializeCanUsb();
+	// Every frame comes with the adapter's time, see trace_received()
+	enableTimestamps( TRUE );
 
-    if( bin != NULL )
-    {    
-        fseek( bin, 0, SEEK_SET );
-        read_bytes = fread( data, sizeof(unsigned char), 512*1024, bin );
-        fclose( bin );
-    }
+	if( simulate )
+	{
+		// Everything below goes to the simulated Trionic instead
+		if( !startT7Sim( &sim_config, sim_image ) )
+		{
+			printf("Failed to start simulator\n");
+			fprintf( log_output, "Failed to start simulator\n");
+			return -1;
+		}
+		fprintf( log_output, "Simulated Trionic, %ld bit/s, %ld us latency\n",
+				 sim_config.bitrate, sim_config.latency_us );
+	}
+	else
+	{
+		ftStatus = openAdapter( adapter_serial, &h );
+		if(ftStatus != FT_OK) {
+			printf("FT_OpenEx() failed. rv=%d\n", ftStatus);
+			printf("Failed to open device\n");
+			fprintf( log_output, "Failed to open device\n");
+			return -1;
+		}
+		
+		FT_ResetDevice(h);
+		FT_Purge(h, FT_PURGE_RX | FT_PURGE_TX);
+		
+		setTimeouts( h, 0x20, 0x40 );       //  read + write timeouts 0x80 0x17A
+		tune_usb( h );
+		enableRxEvent(h);
+		// find_bus() listens to every frame while looking for a bus
+	}
+	
+    if( simulate )
+        bus = BUS_PBUS;         /* the simulated Trionic listens at any bitrate */
     else
     {
-        printf("Error: could not open file %s!\n", filename);
-        fprintf( log_output, "Error: could not open file %s!\n", filename);
-    }
-    
-    if( read_bytes == 256*1024 )
-    {
-        printf("Error: is this a Trionic 5 ECU binary?\n");
-        fprintf( log_output, "Error: is this a Trionic 5 ECU binary?\n");
-    }
-    else if( read_bytes == 512*1024 || read_bytes == 0x70100 )
-    {
-        // Convert Motorola byte-order to Intel byte-order (just in RAM)
-        if( data[0] == 0xFF && data[1] == 0xFF && data[2] == 0xFC && data[3] == 0xEF )
+        printf("Looking for the bus...");
+        fprintf( log_output, "Looking for the bus...");
+        bus = find_bus( h );
+        if( bus < 0 )
         {
-            for( i = 0; i < read_bytes; i += 2 )
-            {
-                temp = data[i];
-                data[i] = data[i+1];
-                data[i+1] = temp;
-            }
-            printf("Note: Motorola byte-order detected.\n");
-            fprintf( log_output, "Note: Motorola byte-order detected.\n");
+            printf("Error: could not receive any messages from either I-Bus or P-Bus!\n");
+            fprintf( log_output, "Error: could not receive any messages from either I-Bus or P-Bus!\n");
+
+            closeChannel( h );
+            printf("\nCAN channel closed.\n");
+            fprintf( log_output, "\nCAN channel closed.\n");
+            return -1;
         }
-        
+        printf("Message received from %s.\n", buses[bus].name);
+        fprintf( log_output, "Message received from %s.\n", buses[bus].name);
     }
 
-    binary_length = read_bytes;
-    return (read_bytes == 512*1024 || read_bytes == 0x70100 ) ? 0 : -1;
+    printf("Opening CAN channel to %s...", buses[bus].name);
+    fprintf( log_output, "Opening CAN channel to %s...", buses[bus].name);
+    if ( !openChannel( h, buses[bus].bitrate ) ) {
+        printf("Failed to open channel\n");
+        fprintf( log_output, "Failed to open channel\n");
+        return -1;
+    }
+    printf("ok\n");
+    fprintf( log_output, "ok\n");
+
+
+    // From here on frames are assembled by the receive thread, and the
+    // Trionic's answers are kept apart from the other bus traffic
+    openRxQueue( 0x238 );
+    openRxQueue( 0x258 );
+    startRxThread( h );
+
+    *handle = h;
+    return 0;
 }
 
-int save_file(const char *filename, const unsigned char *data)
+/* Listen for traffic at each bitrate a Saab bus may have, starting with
+   the one that worked last time on this adapter. Returns the index in
+   buses[], -1 if nothing was heard on any of them. */
+int find_bus( FT_HANDLE h )
 {
-    FILE *bin;
-    int i;
-    size_t write_bytes;
+    char serial[16], bitrate[BUF_SIZE];
+    const char *bitrates[BUSES];
+    int order[BUSES];
+    int i, n, found;
 
-    write_bytes = 0;
-    bin = fopen( filename, "wb" );
+    adapter_id( h, serial, sizeof(serial) );
 
-    if( bin != NULL )
-    {    
-        fseek( bin, 0, SEEK_SET );
-        write_bytes = fwrite( data, sizeof(unsigned char), 512*1024, bin );
-        fclose( bin );
+    n = 0;
+    if( serial[0] != 0 && load_setting( BITRATE_FILE, serial, bitrate, sizeof(bitrate) ) == 0 )
+    {
+        for( i = 0; i < BUSES; i++ )
+        {
+            if( strcmp( buses[i].bitrate, bitrate ) == 0 )
+                order[n++] = i;
+        }
     }
-    else
+    for( i = 0; i < BUSES; i++ )
     {
-        printf("Error: could not open file %s!\n", filename);
-        fprintf( log_output, "Error: could not open file %s!\n", filename);
+        if( n == 0 || order[0] != i )
+            order[n++] = i;
     }
-    
-    return write_bytes == 512*1024 ? 0 : -1;
+    for( i = 0; i < BUSES; i++ )
+        bitrates[i] = buses[order[i]].bitrate;
+
+    found = detectBitrate( h, bitrates, BUSES, BUS_PROBE_US );
+    if( found < 0 )
+        return -1;
+    if( found > 0 && serial[0] != 0 )
+        save_setting( BITRATE_FILE, serial, buses[order[found]].bitrate );
+    return order[found];
 }
 
-unsigned short calc_auth_key( unsigned short seed, unsigned char method )
+/* Serial number of the open adapter, the one asked for with U if the
+   driver does not tell; empty if neither is known */
+void adapter_id( FT_HANDLE h, char *serial, int size )
 {
-    unsigned short key;
-    
-    key = seed << 2;
-    key &= 0xFFFF;
-    key ^= ( method ? 0x4081 : 0x8142 );
-    key -= ( method ? 0x1F6F : 0x2356 );
-    key &= 0xFFFF;
-    
-    return key;
+    if( !getAdapterSerial( h, serial, size ) )
+        snprintf( serial, size, "%s", adapter_serial != NULL ? adapter_serial : "" );
 }
 
-void ask_header( CANHANDLE handle, unsigned char header_id, unsigned char *answer)
+/* Path of a settings file kept per adapter in $HOME, "serial value" on
+   each line */
+void settings_file( const char *name, char *path, int size )
 {
-    unsigned char data[8], length, i;
-    int ret;
-    unsigned char query[8] = { 0x40, 0xA1, 0x02, 0x1A, 0x00, 0x00, 0x00, 0x00 };
-    unsigned char ack[8]   = { 0x40, 0xA1, 0x3F, 0x00, 0x00, 0x00, 0x00, 0x00 };
-    
-   
-    query[4] = header_id;
-    data[0] = 0x00;
-    
-    // Send query to Trionic
-    ret = send_msg( handle, 0x240, query );
-    
-    if( ret != ERROR_CANUSB_OK )
+    const char *home = getenv( "HOME" );
+
+    snprintf( path, size, "%s/%s", home != NULL ? home : ".", name );
+}
+
+/* The value kept in settings file name for adapter serial. Returns 0, or
+   -1 if there is none. */
+int load_setting( const char *name, const char *serial, char *value, int size )
+{
+    FILE *f;
+    char path[512], line[128], id[64];
+    int n;
+
+    settings_file( name, path, sizeof(path) );
+    f = fopen( path, "r" );
+    if( f == NULL ) return -1;
+    while( fgets( line, sizeof(line), f ) != NULL )
     {
-        printf("Send failed, err %d.\n", ret);
-        fprintf( log_output, "Send failed, err %d.\n", ret);
-        usleep(100000); //sleep(100);
-        // Send query to Trionic
-        ret = send_msg( handle, 0x240, query );
-        if( ret != ERROR_CANUSB_OK )
+        if( sscanf( line, "%63s %n", id, &n ) == 1 && strcmp( id, serial ) == 0 )
         {
-            printf("Send retry failed, err %d.\n", ret);
-            fprintf( log_output, "Send retry failed, err %d.\n", ret);
+            line[strcspn( line, "\r\n" )] = 0;
+            snprintf( value, size, "%s", line + n );
+            fclose( f );
+            return 0;
         }
     }
+    fclose( f );
+    return -1;
+}
 
-    // Read response messages
-    while( data[0] != 0x80 && data[0] != 0xC0 )
+/* Keep value for adapter serial in settings file name. The file is
+   rewritten under another name and renamed, so a process reading it at
+   the same time sees either the old or the new one. */
+int save_setting( const char *name, const char *serial, const char *value )
+{
+    FILE *f, *out;
+    char path[512], tmp[520], line[128], id[64];
+    int n = 0;
+
+    settings_file( name, path, sizeof(path) );
+    snprintf( tmp, sizeof(tmp), "%s.%d", path, (int)getpid() );
+    out = fopen( tmp, "w" );
+    if( out == NULL ) return -1;
+
+    f = fopen( path, "r" );
+    if( f != NULL )
     {
-        if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+        while( fgets( line, sizeof(line), f ) != NULL && n < SETTINGS_MAX_ADAPTERS - 1 )
         {
-            if( data[0] & 0x40 )
-            {
-                if( data[2] > 2 ) length = data[2] - 2;   // subtract two non-payload bytes
-                else length = 0;
-                if( --length > 0 ) *answer++ = data[5];
-                if( --length > 0 ) *answer++ = data[6];
-                if( --length > 0 ) *answer++ = data[7];
-            }
+            if( sscanf( line, "%63s", id ) != 1 || strcmp( id, serial ) == 0 )
+                continue;
+            fputs( line, out );
+            if( strchr( line, '\n' ) == NULL ) fputc( '\n', out );
+            n++;
+        }
+        fclose( f );
+    }
+    fprintf( out, "%s %s\n", serial, value );
+    if( fclose( out ) != 0 || rename( tmp, path ) != 0 )
+    {
+        unlink( tmp );
+        return -1;
+    }
+    return 0;
+}
+
+/* Put the USB settings measured best by calibrate_usb() for this adapter
+   into effect, or the defaults if it was never calibrated */
+void tune_usb( FT_HANDLE h )
+{
+    char serial[16], value[64];
+    unsigned int latency = USB_LATENCY_DEFAULT;
+    unsigned long transfer = USB_TRANSFER_DEFAULT;
+    const char *source = "default";
+
+    adapter_id( h, serial, sizeof(serial) );
+    if( serial[0] != 0 && load_setting( USB_PROFILE_FILE, serial, value, sizeof(value) ) == 0 &&
+        sscanf( value, "%u %lu", &latency, &transfer ) == 2 )
+        source = "calibrated";
+
+    if( !setUsbTuning( h, latency, transfer ) )
+    {
+        printf("Warning: could not set USB latency timer %u ms and transfer size %lu\n", latency, transfer);
+        fprintf( log_output, "Warning: could not set USB latency timer %u ms and transfer size %lu\n", latency, transfer);
+        return;
+    }
+    printf("USB latency timer %u ms, transfer size %lu (%s)\n", latency, transfer, source);
+    fprintf( log_output, "USB latency timer %u ms, transfer size %lu (%s)\n", latency, transfer, source);
+}
+
+/* User and system CPU time of the process so far, driver threads
+   included */
+long long cpu_time_us()
+{
+    struct rusage usage;
+
+    getrusage( RUSAGE_SELF, &usage );
+    return (long long)( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/* Try every latency timer and transfer size on the adapter with a short
+   run of version requests, each a round trip through USB and the
+   adapter, and keep the best for its serial number. The channel stays
+   closed throughout, so the adapter never touches whatever bus it is
+   attached to. tune_usb() puts it
+   into effect for every later session. The best has the lowest p99
+   round trip; settings close to it are told apart by CPU time. */
+int calibrate_usb( int argc, char *argv[] )
+{
+    static const unsigned int latencies[] = { 1, 2, 4, 8, 16 };
+    static const unsigned long transfers[] = { 64, 512, 4096, 0x8000 };
+    CALIBRATION results[CALIBRATE_SETTINGS];
+    CANUSB_HISTOGRAM round_trip;
+    CANUSB_COMMAND close_step = { "C", TRUE, "" };  /* BELL if it is closed already */
+    CANUSB_COMMAND version_step = { "V", FALSE, "" };
+    FT_HANDLE h = NULL;
+    FT_STATUS ftStatus;
+    char serial[16], value[64];
+    long long start_us, start_cpu, t;
+    int n, best, i, k, r, failed;
+
+    log_output = stdout;
+    for( k = 2; k < argc; k++ )
+    {
+        if( ( *argv[k] == 'U' || *argv[k] == 'u' ) && argv[k][1] == ',' && argv[k][2] != 0 )
+            adapter_serial = argv[k] + 2;
+        else
+        {
+            printf("Error: unknown option %s\n", argv[k]);
+            return -1;
+        }
+    }
+
+    initializeCanUsb();
+    ftStatus = openAdapter( adapter_serial, &h );
+    if( ftStatus != FT_OK )
+    {
+        printf("FT_OpenEx() failed. rv=%d\n", ftStatus);
+        printf("Failed to open device\n");
+        return -1;
+    }
+    adapter_id( h, serial, sizeof(serial) );
+    if( serial[0] == 0 )
+    {
+        printf("Error: the CANUSB did not tell its serial number\n");
+        FT_Close( h );
+        return -1;
+    }
+    FT_ResetDevice( h );
+    FT_Purge( h, FT_PURGE_RX | FT_PURGE_TX );
+    setTimeouts( h, 0x20, 0x40 );
+    enableRxEvent( h );
+    runCommands( h, &close_step, 1, CALIBRATE_TIMEOUT_US );
+
+    printf("Calibrating CANUSB %s with %d version requests per setting\n\n", serial, CALIBRATE_ROUNDS);
+    printf("latency ms  transfer    p50 us    p99 us  cpu us\n");
+    n = 0;
+    for( i = 0; i < (int)( sizeof(latencies) / sizeof(latencies[0]) ); i++ )
+    {
+        for( k = 0; k < (int)( sizeof(transfers) / sizeof(transfers[0]) ); k++ )
+        {
+            if( !setUsbTuning( h, latencies[i], transfers[k] ) ) continue;
+            runCommands( h, &version_step, 1, CALIBRATE_TIMEOUT_US );   /* settle */
+
+            memset( &round_trip, 0, sizeof(round_trip) );
+            failed = 0;
+            start_cpu = cpu_time_us();
+            for( r = 0; r < CALIBRATE_ROUNDS; r++ )
+            {
+                start_us = get_time_us();
+                if( runCommands( h, &version_step, 1, CALIBRATE_TIMEOUT_US ) != 1 ) failed++;
+                else recordHistogram( &round_trip, get_time_us() - start_us );
+            }
+            t = cpu_time_us() - start_cpu;
+            if( failed > 0 )
+            {
+                printf("%10u  %8lu  %d requests unanswered\n", latencies[i], transfers[k], failed);
+                continue;
+            }
+
+            results[n].latency = latencies[i];
+            results[n].transfer = transfers[k];
+            results[n].p50 = histogramPercentile( &round_trip, 50.0 );
+            results[n].p99 = histogramPercentile( &round_trip, 99.0 );
+            results[n].cpu = t / CALIBRATE_ROUNDS;
+            printf("%10u  %8lu  %8lu  %8lu  %6ld\n", results[n].latency, results[n].transfer,
+                   results[n].p50, results[n].p99, results[n].cpu);
+            n++;
+        }
+    }
+
+    if( n == 0 )
+    {
+        printf("\nError: no setting worked, nothing saved\n");
+        FT_Close( h );
+        return -1;
+    }
+    best = 0;
+    for( i = 1; i < n; i++ )
+    {
+        if( results[i].p99 < results[best].p99 ) best = i;
+    }
+    k = best;
+    for( i = 0; i < n; i++ )
+    {
+        if( results[i].p99 * 100 <= results[best].p99 * ( 100 + CALIBRATE_SLACK_PERCENT ) &&
+            ( results[i].cpu < results[k].cpu ||
+              ( results[i].cpu == results[k].cpu && results[i].p50 < results[k].p50 ) ) )
+            k = i;
+    }
+
+    setUsbTuning( h, results[k].latency, results[k].transfer );
+    FT_Close( h );
+    sprintf( value, "%u %lu", results[k].latency, results[k].transfer );
+    if( save_setting( USB_PROFILE_FILE, serial, value ) != 0 )
+    {
+        printf("\nError: could not save the setting\n");
+        return -1;
+    }
+    printf("\nBest: latency timer %u ms, transfer size %lu (p50 %lu us, p99 %lu us), saved for %s\n",
+           results[k].latency, results[k].transfer, results[k].p50, results[k].p99, serial);
+    return 0;
+}
+
+/* Close the CAN channel at the end of a session, unless the daemon keeps
+   it open for the next job */
+void release_bus( FT_HANDLE h )
+{
+    if( bus_open )
+    {
+        printf("\nCAN channel left open for the next job.\n");
+        fprintf( log_output, "\nCAN channel left open for the next job.\n");
+        return;
+    }
+    closeChannel( h );
+    printf("\nCAN channel closed.\n");
+    fprintf( log_output, "\nCAN channel closed.\n");
+}
+
+/* Warn before programming, non-zero if the user wants to go ahead */
+int confirm_programming()
+{
+    unsigned char answer;
+
+    printf(/*"Ensure that the VIN shown above is the correct one!\n\n"*/
+           "Note! If programming fails, you will probably have to re-program it using the\n"
+           "BDM interface. This means getting the right hardware, opening the Trionic box,\n"
+           "soldering a pin header to the circuit board and using special software.\n\n");
+
+    printf("Are you SURE you want to program [y/N] ? ");
+    answer = (unsigned char)getchar();
+    printf("\n");
+    return answer == 'y' || answer == 'Y';
+}
+
+int load_file(const char *filename, IMAGE *image)
+{
+    unsigned char *data;
+    size_t read_bytes;
+
+    read_bytes = 0;
+    if( loadImage( image, filename ) == 0 )
+    {    
+        read_bytes = image->length;
+    }
+    else
+    {
+        printf("Error: could not open file %s!\n", filename);
+        fprintf( log_output, "Error: could not open file %s!\n", filename);
+    }
+    data = image->data;
+    binary = data;
+    
+    if( read_bytes == 256*1024 )
+    {
+        printf("Error: is this a Trionic 5 ECU binary?\n");
+        fprintf( log_output, "Error: is this a Trionic 5 ECU binary?\n");
+    }
+    else if( read_bytes == 512*1024 || read_bytes == 0x70100 )
+    {
+        // Convert Motorola byte-order to Intel byte-order (just in RAM),
+        // sum it and find the erased parts in the same pass
+        scanImage( data, read_bytes, &write_scan );
+        if( write_scan.motorola )
+        {
+            printf("Note: Motorola byte-order detected.\n");
+            fprintf( log_output, "Note: Motorola byte-order detected.\n");
+        }
+        fprintf( log_output, "Checksum 0x%08lX, 0x%05lX bytes erased\n",
+                 write_scan.checksum & 0xFFFFFFFF, write_scan.erased );
+        indexHeader( &write_header, data, read_bytes );
+    }
+
+    binary_length = read_bytes;
+    return (read_bytes == 512*1024 || read_bytes == 0x70100 ) ? 0 : -1;
+}
+
+unsigned short calc_auth_key( unsigned short seed, unsigned char method )
+{
+    unsigned short key;
+    
+    key = seed << 2;
+    key &= 0xFFFF;
+    key ^= ( method ? 0x4081 : 0x8142 );
+    key -= ( method ? 0x1F6F : 0x2356 );
+    key &= 0xFFFF;
+    
+    return key;
+}
+
+void ask_header( CANHANDLE handle, unsigned char header_id, unsigned char *answer)
+{
+    unsigned char data[8], length, i;
+    int ret;
+    unsigned char query[8] = { 0x40, 0xA1, 0x02, 0x1A, 0x00, 0x00, 0x00, 0x00 };
+    unsigned char ack[8]   = { 0x40, 0xA1, 0x3F, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    
+   
+    query[4] = header_id;
+    data[0] = 0x00;
+    
+    // Send query to Trionic
+    ret = send_msg( handle, 0x240, query );
+    
+    if( ret != ERROR_CANUSB_OK )
+    {
+        printf("Send failed, err %d.\n", ret);
+        fprintf( log_output, "Send failed, err %d.\n", ret);
+        usleep(100000); //sleep(100);
+        // Send query to Trionic
+        ret = send_msg( handle, 0x240, query );
+        if( ret != ERROR_CANUSB_OK )
+        {
+            printf("Send retry failed, err %d.\n", ret);
+            fprintf( log_output, "Send retry failed, err %d.\n", ret);
+        }
+    }
+
+    // Read response messages
+    while( data[0] != 0x80 && data[0] != 0xC0 )
+    {
+        if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+        {
+            if( data[0] & 0x40 )
+            {
+                if( data[2] > 2 ) length = data[2] - 2;   // subtract two non-payload bytes
+                else length = 0;
+                if( --length > 0 ) *answer++ = data[5];
+                if( --length > 0 ) *answer++ = data[6];
+                if( --length > 0 ) *answer++ = data[7];
+            }
             else
             {
                 for( i = 0; i < 6; i++ )
@@ -1042,19 +1697,29 @@ int program_trionic( CANHANDLE handle, unsigned char *bin, const char *vin, cons
     const char jump_msg1b[8]   = { 0x00, 0xA1, 0x07, 0xB0, 0x00, 0x00, 0x00, 0x00 };
     const char jump_msg2a[8]   = { 0x41, 0xA1, 0x08, 0x34, 0x07, 0xFF, 0x00, 0x00 };    // 0x07FF00 length=0x000100
     const char jump_msg2b[8]   = { 0x00, 0xA1, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00 };
-    const char end_data_msg[8] = { 0x40, 0xA1, 0x01, 0x37, 0x00, 0x00, 0x00, 0x00 };
-    const char exit_diag_msg[8]= { 0x40, 0xA1, 0x02, 0x31, 0x54, 0x00, 0x00, 0x00 };
-    const char req_diag_result_msg[8]= { 0x3F, 0x81, 0x01, 0x33, 0x02, 0x40, 0x00, 0x00 };  // 220h
     unsigned char ack[8]       = { 0x40, 0xA1, 0x3F, 0x00, 0x00, 0x00, 0x00, 0x00 };        // 266h
     unsigned char data[8];
     int i, k, bin_count;
+    TX_BLOCK block;
     //HANDLE hout = GetStdHandle(STD_OUTPUT_HANDLE);
     //CONSOLE_SCREEN_BUFFER_INFO csbi;
     
 
     bin_count = 0;
+    block.count = 0;
     //GetConsoleScreenBufferInfo(hout, &csbi);
 
+    if( skip_erased )
+    {
+        // Same ranges as below, but only the blocks that hold data
+        if( program_skip_erased( handle, bin, 0x000000, 0x07B000 ) != 0 ||
+            program_skip_erased( handle, bin, 0x07FF00, 0x080000 ) != 0 )
+        {
+            return -1;
+        }
+        return end_program_trionic( handle, vin, swdate, tester, 0x80000 );
+    }
+
     // Send "Request Download - tool to module" to Trionic
     send_msg( handle, 0x240, jump_msg1a );
     send_msg( handle, 0x240, jump_msg1b );
@@ -1108,11 +1773,10 @@ int program_trionic( CANHANDLE handle, unsigned char *bin, const char *vin, cons
                     }
                     //for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
                     //printf("\n");
-                    usleep(3000); //sleep(3);
-                    send_msg( handle, 0x240, data );
+                    queue_frame( &block, 0x240, data );
                 }
                 // Read response
-                if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+                if( send_block( handle, &block, data ) == 0x258 )
                 {
                     // Send acknowledgement
                     ack[3] = data[0] & 0xBF;
@@ -1174,11 +1838,10 @@ int program_trionic( CANHANDLE handle, unsigned char *bin, const char *vin, cons
                 }
                 //for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
                 //printf("\n");
-                usleep(3000); //sleep(3);
-                send_msg( handle, 0x240, data );
+                queue_frame( &block, 0x240, data );
             }
             // Read response
-            if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+            if( send_block( handle, &block, data ) == 0x258 )
             {
                 // Send acknowledgement
                 ack[3] = data[0] & 0xBF;
@@ -1253,11 +1916,10 @@ int program_trionic( CANHANDLE handle, unsigned char *bin, const char *vin, cons
                         }
                         //for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
                         //printf("\n");
-                        usleep(3000); //sleep(3);
-                        send_msg( handle, 0x240, data );
+                        queue_frame( &block, 0x240, data );
                     }
                     // Read response
-                    if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+                    if( send_block( handle, &block, data ) == 0x258 )
                     {
                         // Send acknowledgement
                         ack[3] = data[0] & 0xBF;
@@ -1309,11 +1971,10 @@ int program_trionic( CANHANDLE handle, unsigned char *bin, const char *vin, cons
                         }
                         //for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
                         //printf("\n");
-                        usleep(3000); //sleep(3);
-                        send_msg( handle, 0x240, data );
+                        queue_frame( &block, 0x240, data );
                     }
                     // Read response
-                    if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+                    if( send_block( handle, &block, data ) == 0x258 )
                     {
                         // Send acknowledgement
                         ack[3] = data[0] & 0xBF;
@@ -1371,88 +2032,7 @@ int program_trionic( CANHANDLE handle, unsigned char *bin, const char *vin, cons
         return -1;
     }
 
-    // Quit now, if Raw write has been selected
-    if( vin == NULL && swdate == NULL && tester == NULL )
-    {
-        return 0;
-    }
-
-   // Send "Request Data Transfer Exit" to Trionic
-    send_msg( handle, 0x240, end_data_msg );
-
-    // Read response
-    if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
-    {
-        // Send acknowledgement
-        ack[3] = data[0] & 0xBF;
-        send_msg( handle, 0x266, ack );
-        if( data[3] == 0x77 )
-        {
-            // Program VIN
-            write_data_block( handle, 0x90, vin);
-            // Program software date
-            write_data_block( handle, 0x99, swdate);
-            // Program tester info
-            write_data_block( handle, 0x98, tester);
-
-            // Send "Exit diagnostic routine"
-            send_msg( handle, 0x240, exit_diag_msg );
-            if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
-            {
-                // Send acknowledgement
-                ack[3] = data[0] & 0xBF;
-                send_msg( handle, 0x266, ack );
-                if( data[3] != 0x71 )
-                {
-                    printf("err line: %d (0x%02X)\n", __LINE__, data[3] );
-                    fprintf( log_output, "%5.1f %% done\n", (float)bin_count/(float)(512*1024)*100.0);
-                    fprintf( log_output, "err line: %d (0x%02X)\n", __LINE__, data[3] );
-                    return -1;
-                }             
-            }
-            else
-            {
-                printf("err line: %d\n", __LINE__ );
-                fprintf( log_output, "%5.1f %% done\n", (float)bin_count/(float)(512*1024)*100.0);
-                fprintf( log_output, "err line: %d\n", __LINE__ );
-                return -1;
-            }
-/*
-            // Sleep 5 seconds
-            sleep(5000);
-            
-            // Send "Request diagnostic results"
-            send_msg( handle, 0x220, req_diag_result_msg );
-            if( wait_for_msg( handle, 0x239, 1000, data ) == 0x239 )
-            {
-                printf("\nDiagnostic results...\n");
-                for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
-                printf("\n");
-            }
-            else
-            {
-                printf("err line: %d\n", __LINE__ );
-                return -1;
-            }
-*/
-        }
-        else
-        {
-            printf("err line: %d (0x%02X)\n", __LINE__, data[3] );
-            fprintf( log_output, "%5.1f %% done\n", (float)bin_count/(float)(512*1024)*100.0);
-            fprintf( log_output, "err line: %d (0x%02X)\n", __LINE__, data[3] );
-            return -1;
-        }
-    }
-    else
-    {
-        printf("err line: %d\n", __LINE__ );
-        fprintf( log_output, "%5.1f %% done\n", (float)bin_count/(float)(512*1024)*100.0);
-        fprintf( log_output, "err line: %d\n", __LINE__ );
-        return -1;
-    }
-    
-    return 0;
+    return end_program_trionic( handle, vin, swdate, tester, bin_count );
 }
 
 int program_trionic_tis( CANHANDLE handle, unsigned char *bin, const char *vin, const char *swdate, const char *tester )
@@ -1467,11 +2047,13 @@ int program_trionic_tis( CANHANDLE handle, unsigned char *bin, const char *vin,
     unsigned char ack[8]       = { 0x40, 0xA1, 0x3F, 0x00, 0x00, 0x00, 0x00, 0x00 };        // 266h
     unsigned char data[8];
     int i, k, bin_count;
+    TX_BLOCK block;
     //HANDLE hout = GetStdHandle(STD_OUTPUT_HANDLE);
     //CONSOLE_SCREEN_BUFFER_INFO csbi;
     
 
     bin_count = 0;
+    block.count = 0;
     //GetConsoleScreenBufferInfo(hout, &csbi);
 
     // Send "Request Download - tool to module" to Trionic
@@ -1525,11 +2107,10 @@ int program_trionic_tis( CANHANDLE handle, unsigned char *bin, const char *vin,
                     }
                     //for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
                     //printf("\n");
-                    usleep(3000); //sleep(3);
-                    send_msg( handle, 0x240, data );
+                    queue_frame( &block, 0x240, data );
                 }
                 // Read response
-                if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+                if( send_block( handle, &block, data ) == 0x258 )
                 {
                     // Send acknowledgement
                     ack[3] = data[0] & 0xBF;
@@ -1587,11 +2168,10 @@ int program_trionic_tis( CANHANDLE handle, unsigned char *bin, const char *vin,
                 }
                 //for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
                 //printf("\n");
-                usleep(3000); //sleep(3);
-                send_msg( handle, 0x240, data );
+                queue_frame( &block, 0x240, data );
             }
             // Read response
-            if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+            if( send_block( handle, &block, data ) == 0x258 )
             {
                 // Send acknowledgement
                 ack[3] = data[0] & 0xBF;
@@ -1666,11 +2246,10 @@ int program_trionic_tis( CANHANDLE handle, unsigned char *bin, const char *vin,
                         }
                         //for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
                         //printf("\n");
-                        usleep(3000); //sleep(3);
-                        send_msg( handle, 0x240, data );
+                        queue_frame( &block, 0x240, data );
                     }
                     // Read response
-                    if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+                    if( send_block( handle, &block, data ) == 0x258 )
                     {
                         // Send acknowledgement
                         ack[3] = data[0] & 0xBF;
@@ -1722,11 +2301,10 @@ int program_trionic_tis( CANHANDLE handle, unsigned char *bin, const char *vin,
                         }
                         //for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
                         //printf("\n");
-                        usleep(3000); //sleep(3);
-                        send_msg( handle, 0x240, data );
+                        queue_frame( &block, 0x240, data );
                     }
                     // Read response
-                    if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+                    if( send_block( handle, &block, data ) == 0x258 )
                     {
                         // Send acknowledgement
                         ack[3] = data[0] & 0xBF;
@@ -1862,12 +2440,225 @@ int program_trionic_tis( CANHANDLE handle, unsigned char *bin, const char *vin,
     return 0;
 }
 
-int write_data_block( CANHANDLE handle, unsigned char header_id, const unsigned char *block)
+/* Leave the download session and write the header fields, shared by the
+   full and the skip-erased transfer in program_trionic() */
+int end_program_trionic( CANHANDLE handle, const char *vin, const char *swdate, const char *tester, int bin_count )
 {
-    unsigned char data[8], length, rows;
-    int i, k;
-    float row_temp;
-    unsigned char write[8] = { 0x40, 0xA1, 0x00, 0x3B, 0x00, 0x00, 0x00, 0x00 };
+    const char end_data_msg[8] = { 0x40, 0xA1, 0x01, 0x37, 0x00, 0x00, 0x00, 0x00 };
+    const char exit_diag_msg[8]= { 0x40, 0xA1, 0x02, 0x31, 0x54, 0x00, 0x00, 0x00 };
+    unsigned char ack[8]       = { 0x40, 0xA1, 0x3F, 0x00, 0x00, 0x00, 0x00, 0x00 };        // 266h
+    unsigned char data[8];
+
+    // Quit now, if Raw write has been selected
+    if( vin == NULL && swdate == NULL && tester == NULL )
+    {
+        return 0;
+    }
+
+   // Send "Request Data Transfer Exit" to Trionic
+    send_msg( handle, 0x240, end_data_msg );
+
+    // Read response
+    if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+    {
+        // Send acknowledgement
+        ack[3] = data[0] & 0xBF;
+        send_msg( handle, 0x266, ack );
+        if( data[3] == 0x77 )
+        {
+            // Program VIN
+            write_data_block( handle, 0x90, vin);
+            // Program software date
+            write_data_block( handle, 0x99, swdate);
+            // Program tester info
+            write_data_block( handle, 0x98, tester);
+
+            // Send "Exit diagnostic routine"
+            send_msg( handle, 0x240, exit_diag_msg );
+            if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
+            {
+                // Send acknowledgement
+                ack[3] = data[0] & 0xBF;
+                send_msg( handle, 0x266, ack );
+                if( data[3] != 0x71 )
+                {
+                    printf("err line: %d (0x%02X)\n", __LINE__, data[3] );
+                    fprintf( log_output, "%5.1f %% done\n", (float)bin_count/(float)(512*1024)*100.0);
+                    fprintf( log_output, "err line: %d (0x%02X)\n", __LINE__, data[3] );
+                    return -1;
+                }             
+            }
+            else
+            {
+                printf("err line: %d\n", __LINE__ );
+                fprintf( log_output, "%5.1f %% done\n", (float)bin_count/(float)(512*1024)*100.0);
+                fprintf( log_output, "err line: %d\n", __LINE__ );
+                return -1;
+            }
+/*
+            // Sleep 5 seconds
+            sleep(5000);
+            
+            // Send "Request diagnostic results"
+            send_msg( handle, 0x220, req_diag_result_msg );
+            if( wait_for_msg( handle, 0x239, 1000, data ) == 0x239 )
+            {
+                printf("\nDiagnostic results...\n");
+                for( k = 0; k < 8; k++ ) printf("0x%02X ", data[k]);
+                printf("\n");
+            }
+            else
+            {
+                printf("err line: %d\n", __LINE__ );
+                return -1;
+            }
+*/
+        }
+        else
+        {
+            printf("err line: %d (0x%02X)\n", __LINE__, data[3] );
+            fprintf( log_output, "%5.1f %% done\n", (float)bin_count/(float)(512*1024)*100.0);
+            fprintf( log_output, "err line: %d (0x%02X)\n", __LINE__, data[3] );
+            return -1;
+        }
+    }
+    else
+    {
+        printf("err line: %d\n", __LINE__ );
+        fprintf( log_output, "%5.1f %% done\n", (float)bin_count/(float)(512*1024)*100.0);
+        fprintf( log_output, "err line: %d\n", __LINE__ );
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+/* Returns 1 if every byte of the block is 0xFF */
+int block_is_erased( const unsigned char *bin, int len )
+{
+    return isErased( bin, len );
+}
+
+/* Queue one "Data Transfer" of len (1...240) bytes as rows of 6 bytes,
+   the first row carries the length, service id and 4 bytes */
+void queue_data_block( TX_BLOCK *block, const unsigned char *bin, int len )
+{
+    unsigned char data[8];
+    int i, k, rows;
+
+    rows = len > 4 ? ( len - 4 + 5 ) / 6 : 0;
+    data[1] = 0xA1;
+    for( i = rows; i >= 0; i-- )
+    {
+        data[0] = i;
+        if( i == rows )
+        {
+            data[0] |= 0x40;
+            data[2] = len + 1; // length
+            data[3] = 0x36; // Data Transfer
+            for( k = 4; k < 8; k++ ) data[k] = len-- > 0 ? *bin++ : 0x00;
+        }
+        else
+        {
+            for( k = 2; k < 8; k++ ) data[k] = len-- > 0 ? *bin++ : 0x00;
+        }
+        queue_frame( block, 0x240, data );
+    }
+}
+
+/* Program start...end in 240 byte blocks, leaving out blocks that are all
+   0xFF since that is what the erased flash already holds. Every run of
+   blocks with data gets its own "Request Download". */
+int program_skip_erased( CANHANDLE handle, const unsigned char *bin, int start, int end )
+{
+    unsigned char jump_msg1a[8] = { 0x41, 0xA1, 0x08, 0x34, 0x00, 0x00, 0x00, 0x00 };
+    unsigned char jump_msg1b[8] = { 0x00, 0xA1, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    unsigned char ack[8]        = { 0x40, 0xA1, 0x3F, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    unsigned char data[8];
+    int addr, run_end, len, skipped;
+    TX_BLOCK block;
+
+    block.count = 0;
+    skipped = 0;
+    addr = start;
+    while( addr < end )
+    {
+        len = ( end - addr ) < 240 ? ( end - addr ) : 240;
+        if( block_is_erased( bin + addr, len ) )
+        {
+            addr += len;
+            skipped += len;
+            continue;
+        }
+
+        // Find the end of this run of blocks with data
+        run_end = addr;
+        while( run_end < end )
+        {
+            len = ( end - run_end ) < 240 ? ( end - run_end ) : 240;
+            if( block_is_erased( bin + run_end, len ) ) break;
+            run_end += len;
+        }
+
+        // Send "Request Download - tool to module" for addr...run_end
+        jump_msg1a[4] = ( addr >> 16 ) & 0xFF;
+        jump_msg1a[5] = ( addr >> 8 ) & 0xFF;
+        jump_msg1a[6] = addr & 0xFF;
+        jump_msg1b[2] = ( ( run_end - addr ) >> 16 ) & 0xFF;
+        jump_msg1b[3] = ( ( run_end - addr ) >> 8 ) & 0xFF;
+        jump_msg1b[4] = ( run_end - addr ) & 0xFF;
+        send_msg( handle, 0x240, jump_msg1a );
+        send_msg( handle, 0x240, jump_msg1b );
+
+        if( wait_for_msg( handle, 0x258, 1000, data ) != 0x258 )
+        {
+            printf("err line: %d\n", __LINE__ );
+            fprintf( log_output, "err line: %d (0x%06X)\n", __LINE__, addr );
+            return -1;
+        }
+        ack[3] = data[0] & 0xBF;
+        send_msg( handle, 0x266, ack );
+        if( data[3] != 0x74 )
+        {
+            printf("err line: %d (0x%02X)\n", __LINE__, data[3] );
+            fprintf( log_output, "err line: %d (0x%06X, 0x%02X)\n", __LINE__, addr, data[3] );
+            return -1;
+        }
+
+        while( addr < run_end )
+        {
+            len = ( run_end - addr ) < 240 ? ( run_end - addr ) : 240;
+            queue_data_block( &block, bin + addr, len );
+            if( send_block( handle, &block, data ) != 0x258 )
+            {
+                printf("err line: %d\n", __LINE__ );
+                fprintf( log_output, "err line: %d (0x%06X)\n", __LINE__, addr );
+                return -1;
+            }
+            ack[3] = data[0] & 0xBF;
+            send_msg( handle, 0x266, ack );
+            if( data[3] != 0x76 )
+            {
+                printf("err line: %d (0x%02X)\n", __LINE__, data[3] );
+                fprintf( log_output, "err line: %d (0x%06X, 0x%02X)\n", __LINE__, addr, data[3] );
+                return -1;
+            }
+            addr += len;
+            printf("%5.1f %% done\r", (float)addr/(float)(512*1024)*100.0);
+        }
+    }
+
+    fprintf( log_output, "\nSkipped %d erased bytes in 0x%06X...0x%06X\n", skipped, start, end );
+    return 0;
+}
+
+int write_data_block( CANHANDLE handle, unsigned char header_id, const unsigned char *block)
+{
+    unsigned char data[8], length, rows;
+    int i, k;
+    float row_temp;
+    unsigned char write[8] = { 0x40, 0xA1, 0x00, 0x3B, 0x00, 0x00, 0x00, 0x00 };
     unsigned char ack[8]   = { 0x40, 0xA1, 0x3F, 0x00, 0x00, 0x00, 0x00, 0x00 };
     
    
@@ -1932,17 +2723,18 @@ int write_data_block( CANHANDLE handle, unsigned char header_id, const unsigned
     
 }
 
-int read_trionic( CANHANDLE handle, int addr, int len, unsigned char *bin)
+int read_trionic( CANHANDLE handle, int addr, int len, IMAGE *image)
 {
+    unsigned char *bin = image->data + addr;
     unsigned char data[8], i, k;
-    int address, length, rcv_len, dot, bytes_this_round, retries, ret;
+    int address, length, rcv_len, dot, bytes_this_round, retries, ret, requested, refused, transferred;
+    long offset, missing;
     const char init_msg[8]     = { 0x20, 0x81, 0x00, 0x11, 0x02, 0x42, 0x00, 0x00 };
-    const char end_data_msg[8] = { 0x40, 0xA1, 0x01, 0x82, 0x00, 0x00, 0x00, 0x00 };
-    char jump_msg1a[8]         = { 0x41, 0xA1, 0x08, 0x2C, 0xF0, 0x03, 0x00, 0xEF };    // 0x000000 length=0xEF
-    char jump_msg1b[8]         = { 0x00, 0xA1, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    const unsigned char end_data_msg[8] = { 0x40, 0xA1, 0x01, 0x82, 0x00, 0x00, 0x00, 0x00 };
     const char post_jump_msg[8]= { 0x40, 0xA1, 0x01, 0x3E, 0x00, 0x00, 0x00, 0x00 };
-    const char data_msg[8]     = { 0x40, 0xA1, 0x02, 0x21, 0xF0, 0x00, 0x00, 0x00 };
+    const unsigned char data_msg[8]     = { 0x40, 0xA1, 0x02, 0x21, 0xF0, 0x00, 0x00, 0x00 };
     unsigned char ack[8]       = { 0x40, 0xA1, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    TX_BLOCK block;
     //HANDLE hout = GetStdHandle(STD_OUTPUT_HANDLE);
     //CONSOLE_SCREEN_BUFFER_INFO csbi;
     
@@ -1952,95 +2744,97 @@ int read_trionic( CANHANDLE handle, int addr, int len, unsigned char *bin)
     data[0] = 0x00;
     dot = 0;
     retries = 0;
+    block.count = 0;
+    transferred = 0;
 
     address = addr;
 
     while( rcv_len < len )
     {
-        bytes_this_round = 0;
-        if( (len - rcv_len) < 0xEF ) jump_msg1a[7] = len - rcv_len;
-        else jump_msg1a[7] = 0xEF;
-        
-        jump_msg1b[2] = (address >> 16) & 0xFF;
-        jump_msg1b[3] = (address >> 8) & 0xFF;
-        jump_msg1b[4] = address & 0xFF;
-    
-        // Send read address and length to Trionic
-        ret = send_msg( handle, 0x240, jump_msg1a );
-        if( ret != ERROR_CANUSB_OK )
+        // Leave out what the journal says an earlier attempt already read
+        offset = address;
+        missing = imageMissing( image, &offset, addr + len );
+        if( offset != address )
         {
-            printf("Send 'jump_msg1a' failed, err %d.\n", ret);
-            fprintf( log_output, "Send 'jump_msg1a' failed, err %d.\n", ret);
-            usleep(10000); //sleep(100);
-            // Retry query to Trionic
-            ret = send_msg( handle, 0x240, jump_msg1a );
-            if( ret != ERROR_CANUSB_OK )
-            {
-                printf("Send 'jump_msg1a' retry failed, err %d.\n", ret);
-                fprintf( log_output, "Send 'jump_msg1a' retry failed, err %d.\n", ret);
-            }
+            rcv_len += offset - address;
+            bin += offset - address;
+            address = offset;
+            continue;
         }
-        ret = send_msg( handle, 0x240, jump_msg1b );
-        if( ret != ERROR_CANUSB_OK )
+
+        bytes_this_round = 0;
+        refused = 0;
+        requested = missing < read_block_size ? missing : read_block_size;
+
+        // Send read address and length to Trionic, behind the acknowledgement
+        // of the previous chunk's last frame if that is still pending
+        queue_read_request( &block, address, missing );
+        transferred = 1;
+        if( !queueFrames( handle, block.msg, block.count ) )
         {
-            printf("Send 'jump_msg1b' failed, err %d.\n", ret);
-            fprintf( log_output, "Send 'jump_msg1b' failed, err %d.\n", ret);
+            printf("Send 'jump_msg1' failed.\n");
+            fprintf( log_output, "Send 'jump_msg1' failed.\n");
             usleep(10000); //sleep(100);
             // Retry query to Trionic
-            ret = send_msg( handle, 0x240, jump_msg1b );
-            if( ret != ERROR_CANUSB_OK )
+            if( !queueFrames( handle, block.msg, block.count ) )
             {
-                printf("Send 'jump_msg1b' retry failed, err %d.\n", ret);
-                fprintf( log_output, "Send 'jump_msg1b' retry failed, err %d.\n", ret);
+                printf("Send 'jump_msg1' retry failed.\n");
+                fprintf( log_output, "Send 'jump_msg1' retry failed.\n");
             }
         }
+        trace_sent( block.msg, block.count );
+        block.count = 0;
     
         if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
         {
 			//printf("wait_for_msg( handle, 0x258, 1000, data ) == 0x258");
-            // Send acknowledgement
             ack[3] = data[0] & 0xBF;
-            send_msg( handle, 0x266, ack );
-            
+            if( data[3] == 0x7F && read_block_size > READ_BLOCK_DEFAULT )
+            {
+                // Block size not accepted, ask again with the standard one
+                send_msg( handle, 0x266, ack );
+                read_block_size_refused( requested );
+                continue;
+            }
             if( data[3] != 0x6C || data[4] != 0xF0 )
             {
+                // Send acknowledgement
+                send_msg( handle, 0x266, ack );
                 printf("err line: %d\n", __LINE__ );
                 fprintf( log_output, "%5.1f %% done (retries = %d)\n", (float)rcv_len/(float)len*100.0, retries);
                 fprintf( log_output, "err line: %d\n", __LINE__ );
                 return -1;
             }
-        }
-        else
-        {
-            printf("err line: %d\n", __LINE__ );
-            fprintf( log_output, "%5.1f %% done (retries = %d)\n", (float)rcv_len/(float)len*100.0, retries);
-            fprintf( log_output, "err line: %d\n", __LINE__ );
-            return -1;
-        }
-/*    
-        // Send post jump message to Trionic
-        send_msg( handle, 0x240, post_jump_msg );
-        if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
-        {
-            // Send acknowledgement
-            ack[3] = data[0] & 0xBF;
-            send_msg( handle, 0x266, ack );
-            
-            if( data[3] != 0x7E )
+
+            // Send acknowledgement and "Data Transfer" to Trionic together
+            queue_frame( &block, 0x266, ack );
+            queue_frame( &block, 0x240, data_msg );
+            if( !queueFrames( handle, block.msg, block.count ) )
             {
-                printf("err line: %d\n", __LINE__ );
-                return -1;
+                printf("Send 'data_msg' failed.\n");
+                fprintf( log_output, "Send 'data_msg' failed.\n");
+                usleep(10000); //sleep(100);
+                // Retry "Data Transfer" to Trionic
+                if( !queueFrames( handle, block.msg, block.count ) )
+                {
+                    printf("Send 'data_msg' retry failed.\n");
+                    fprintf( log_output, "Send 'data_msg' retry failed.\n");
+                    printf("err line: %d\n", __LINE__ );
+                    fprintf( log_output, "%5.1f %% done (retries = %d)\n", (float)rcv_len/(float)len*100.0, retries);
+                    fprintf( log_output, "err line: %d\n", __LINE__ );
+                    return -1;
+                }
             }
+            trace_sent( block.msg, block.count );
+            block.count = 0;
         }
         else
         {
             printf("err line: %d\n", __LINE__ );
+            fprintf( log_output, "%5.1f %% done (retries = %d)\n", (float)rcv_len/(float)len*100.0, retries);
+            fprintf( log_output, "err line: %d\n", __LINE__ );
             return -1;
         }
-*/        
-		//printf("send data transfer to trionic\n");
-        // Send "Data Transfer" to Trionic
-        send_msg( handle, 0x240, data_msg );
         
         // Read response messages
         data[0] = 0x00;
@@ -2050,6 +2844,15 @@ int read_trionic( CANHANDLE handle, int addr, int len, unsigned char *bin)
             {
                 //for( i = 0; i < 8; i++ ) printf("0x%02X ", data[i]);
                 //printf("\n");
+                if( ( data[0] & 0x40 ) && data[3] == 0x7F && read_block_size > READ_BLOCK_DEFAULT )
+                {
+                    // "Data Transfer" refused for this block size
+                    ack[3] = data[0] & 0xBF;
+                    send_msg( handle, 0x266, ack );
+                    read_block_size_refused( requested );
+                    refused = 1;
+                    break;
+                }
                 if( data[0] & 0x40 )
                 {
                     length = data[2] - 2;   // subtract two non-payload bytes
@@ -2086,8 +2889,14 @@ int read_trionic( CANHANDLE handle, int addr, int len, unsigned char *bin)
                         }
                     }
                 }
-                // Send acknowledgement
                 ack[3] = data[0] & 0xBF;
+                if( data[0] == 0x80 || data[0] == 0xC0 )
+                {
+                    // Last frame, acknowledge it together with the next request
+                    queue_frame( &block, 0x266, ack );
+                    continue;
+                }
+                // Send acknowledgement
                 ret = send_msg( handle, 0x266, ack );
                 if( ret != ERROR_CANUSB_OK )
                 {
@@ -2107,6 +2916,7 @@ int read_trionic( CANHANDLE handle, int addr, int len, unsigned char *bin)
             {
                 // Timeout
                 retries++;
+                trace_retry( 0x258 );
                 if( retries < 10 )
                 {
                     rcv_len -= bytes_this_round;
@@ -2125,7 +2935,16 @@ int read_trionic( CANHANDLE handle, int addr, int len, unsigned char *bin)
             }
         }
         
+        // A Trionic that silently sends less than asked for sets the size
+        if( !refused && ( data[0] == 0x80 || data[0] == 0xC0 ) &&
+            bytes_this_round > 0 && bytes_this_round < requested && rcv_len < len )
+        {
+            read_block_size_refused( requested );
+            if( bytes_this_round < read_block_size ) read_block_size = bytes_this_round;
+        }
+
         address = addr + rcv_len;
+        markImage( image, addr, address );
 		//printf("address 0x%X\n",address);
 		//printf("bytesthisround=%d\n",bytes_this_round);
         //SetConsoleCursorPosition( hout, csbi.dwCursorPosition );
@@ -2138,9 +2957,32 @@ int read_trionic( CANHANDLE handle, int addr, int len, unsigned char *bin)
             printf("%5.1f %% done (retries = %d)\n", (float)rcv_len/(float)len*100.0, retries);
         }
     }
+
+    // Nothing was missing, so no transfer to end
+    if( !transferred )
+    {
+        return rcv_len;
+    }
     
-   // Send "Request Data Transfer Exit" to Trionic
-    send_msg( handle, 0x240, end_data_msg );
+   // Send "Request Data Transfer Exit" to Trionic, after the last acknowledgement
+    queue_frame( &block, 0x240, end_data_msg );
+    if( !queueFrames( handle, block.msg, block.count ) )
+    {
+        printf("Send 'end_data_msg' failed.\n");
+        fprintf( log_output, "Send 'end_data_msg' failed.\n");
+        usleep(10000); //sleep(100);
+        // Retry "Request Data Transfer Exit" to Trionic
+        if( !queueFrames( handle, block.msg, block.count ) )
+        {
+            printf("Send 'end_data_msg' retry failed.\n");
+            fprintf( log_output, "Send 'end_data_msg' retry failed.\n");
+            printf("err line: %d\n", __LINE__ );
+            fprintf( log_output, "err line: %d\n", __LINE__ );
+            return -1;
+        }
+    }
+    trace_sent( block.msg, block.count );
+    block.count = 0;
 
     // Read response
     if( wait_for_msg( handle, 0x258, 1000, data ) == 0x258 )
@@ -2178,6 +3020,32 @@ int read_trionic( CANHANDLE handle, int addr, int len, unsigned char *bin)
     return rcv_len;
 }
 
+/* Fall back to the standard read block size once the larger one failed */
+void read_block_size_refused( int requested )
+{
+    if( read_block_size <= READ_BLOCK_DEFAULT ) return;
+    read_block_size = READ_BLOCK_DEFAULT;
+    fprintf( log_output, "\nRead block size 0x%02X not supported, using 0x%02X\n",
+             requested, read_block_size );
+}
+
+/* Queue the two frames that set up a read of up to read_block_size bytes */
+void queue_read_request( TX_BLOCK *block, int address, int length )
+{
+    unsigned char jump_msg1a[8] = { 0x41, 0xA1, 0x08, 0x2C, 0xF0, 0x03, 0x00, 0xEF };    // 0x000000 length=0xEF
+    unsigned char jump_msg1b[8] = { 0x00, 0xA1, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    if( length < read_block_size ) jump_msg1a[7] = length;
+    else jump_msg1a[7] = read_block_size;
+
+    jump_msg1b[2] = (address >> 16) & 0xFF;
+    jump_msg1b[3] = (address >> 8) & 0xFF;
+    jump_msg1b[4] = address & 0xFF;
+
+    queue_frame( block, 0x240, jump_msg1a );
+    queue_frame( block, 0x240, jump_msg1b );
+}
+
 // TODO: Verify needs to take into account the way the header part is written
 // i.e. the written binary will not be exactly the same as the one read
 int verify_trionic( CANHANDLE handle, int addr, int len, const unsigned char *written)
@@ -2381,151 +3249,1205 @@ int send_msg( CANHANDLE handle, int id, const unsigned char *data )
     msg.data[6] = data[6];
     msg.data[7] = data[7];
     
-    return sendFrame( handle, &msg );//canusb_Write( handle, &msg );
-}
-
-int wait_for_msg( FT_HANDLE handle, int id, int timeout, unsigned char *data )
-{
-    CANMsg msg;
-    int timeout_temp;
-    char not_received, got_it;
-    long dwStart;
-    
-    dwStart = time(NULL);
-    timeout_temp = timeout;
-    msg.id = 0x0;
-    not_received = 1;
-    while( not_received == 1 )
+    trace_sent( &msg, 1 );
+    if( !sendFrame( handle, &msg ) )//canusb_Write( handle, &msg );
     {
-		if( readFrame ( handle, &msg ) )
-		{
-			if( msg.id == id || id == 0 )
-			{
-				not_received = 0;
-				*(data+0) = msg.data[0];
-				*(data+1) = msg.data[1];
-				*(data+2) = msg.data[2];
-				*(data+3) = msg.data[3];
-				*(data+4) = msg.data[4];
-				*(data+5) = msg.data[5];
-				*(data+6) = msg.data[6];
-				*(data+7) = msg.data[7];
-				break;
-			}
-		}
-		//else
-		//{
-			//printf(".");
-		//}
-
-        //if( (time(NULL) - dwStart) > timeout )
-		//{
-		//	not_received = 0;	
-		//}
-		//if( --timeout <= 0 )
-		//	not_received = 0;
-        else 
-			usleep(1000);
+        trace_retry( id );
+        return FALSE;
     }
-	//printf("msg.id=%X timeout time: %d\n", msg.id, time(NULL) - dwStart);
-    return msg.id;
+    return ERROR_CANUSB_OK;
 }
 
-int get_header_field_string(const unsigned char *bin, unsigned char id, unsigned char *answer)
+void queue_frame( TX_BLOCK *block, int id, const unsigned char *data )
 {
-     unsigned char byte, length_field, id_field, found_id;
-     unsigned char data[255];
-     unsigned int addr;
-     int i;
-
-     //addr = 0x7FFFF;
-     found_id = 0;
-     addr = binary_length - 1;
-    /* Reads backwards from the end of the binary */
-    //while( addr > 0x7FE00 )
-    //printf("trying to find 0x%02X\n", id);
-    while( addr > (binary_length - 0x1FF) )
-    {
-        /* The first byte is the length of the data */
-        length_field = *(bin+addr);
-        //printf("%3d, ", length_field);
-        if( length_field == 0x00 || length_field == 0xFF ) break;
-        addr--;
-        
-        /* Second byte is an ID field */
-        id_field = *(bin+addr);
-        addr--;
+    CANMsg *msg = &block->msg[block->count++];
 
-        //printf("0x%02X\n", id_field);
+    msg->id = id;
+    msg->len = 8;
+    msg->flags = 0;
+    memcpy( msg->data, data, 8 );
+}
+
+/* Send the queued frames of a block and wait for the Trionic's response.
+   Runs flat out while the adapter and ECU keep up; a refused frame, no
+   response or a negative one makes it back off, first by sending smaller
+   bursts and then by adding a gap between single frames, and send the
+   whole block again, up to PACE_RETRIES times. Returns the id of the
+   last response like wait_for_msg(). */
+int send_block( CANHANDLE handle, TX_BLOCK *block, unsigned char *data )
+{
+    unsigned char ack[8] = { 0x40, 0xA1, 0x3F, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    int i, sent, tries, id = 0;
 
-        /* The actual data */
-        for( i = 0; i < length_field; i++ )
+    for( tries = 0; tries < PACE_RETRIES; tries++ )
+    {
+        if( tries > 0 ) trace_retry( 0x240 );
+        trace_sent( block->msg, block->count );
+        if( pace_gap_us == 0 )
+        {
+            sent = sendFrames( handle, block->msg, block->count );
+        }
+        else
         {
-            if( id_field == id )
+            sent = 1;
+            for( i = 0; i < block->count && sent; i++ )
             {
-                answer[i] = *(bin+addr);
+                usleep( pace_gap_us );
+                sent = sendFrames( handle, &block->msg[i], 1 );
             }
-            addr--;
         }
-        if( id_field == id )
+        if( !sent )
+        {
+            // Only part of the block went out, no response will come
+            pace_backoff( "adapter refused frame" );
+            id = 0;
+            continue;
+        }
+
+        // Read response, skipping "response pending"
+        while( ( id = wait_for_msg( handle, 0x258, 1000, data ) ) == 0x258 &&
+               data[3] == 0x7F && data[5] == 0x78 )
+        {
+            ack[3] = data[0] & 0xBF;
+            send_msg( handle, 0x266, ack );
+        }
+
+        if( id == 0x258 && data[3] == 0x76 )
         {
-            answer[length_field] = 0;
-            found_id = 1;
-            // when this return is commented out, the function will
-            // find the last field if there are several (mainly this
-            // is for searching for the last VIN field)
-            //return 1;
+            pace_success();
+            break;
+        }
+        if( id == 0x258 && data[3] == 0x7F && data[5] == 0x21 )
+            pace_backoff( "busy, repeat request" );
+        else if( id == 0x258 )
+            pace_backoff( "negative response" );
+        else
+            pace_backoff( "no response" );
+
+        // The caller acknowledges only the response it gets
+        if( id == 0x258 && tries + 1 < PACE_RETRIES )
+        {
+            ack[3] = data[0] & 0xBF;
+            send_msg( handle, 0x266, ack );
         }
     }
+
+    block->count = 0;
+    return id;
+}
+
+void pace_backoff( const char *reason )
+{
+    pace_backoffs++;
+    pace_good_blocks = 0;
+    if( getTxBurst() > 1 )
+    {
+        setTxBurst( getTxBurst() / 2 );
+    }
+    else if( pace_gap_us < PACE_GAP_MAX_US )
+    {
+        pace_gap_us += PACE_GAP_STEP_US;
+    }
+    fprintf( log_output, "\nPacing: backing off (%s), bursts of %d frames, %d us gap\n",
+             reason, getTxBurst(), pace_gap_us );
+}
+
+void pace_success( void )
+{
+    if( ++pace_good_blocks < PACE_RECOVER_BLOCKS ) return;
+    pace_good_blocks = 0;
+    if( pace_gap_us > 0 )
+    {
+        pace_gap_us -= PACE_GAP_STEP_US;
+        if( pace_gap_us < 0 ) pace_gap_us = 0;
+    }
+    else if( getTxBurst() < CANUSB_TX_BURST_DEFAULT )
+    {
+        setTxBurst( getTxBurst() * 2 );
+    }
+}
+
+/* Wait up to timeout ms for a frame with this id (any id when 0). Ids
+   given their own queue in main() keep their frames while other ids are
+   waited for. Returns the id, or 0 on timeout. */
+int wait_for_msg( FT_HANDLE handle, int id, int timeout, unsigned char *data )
+{
+    CANMsg msg;
+    long long deadline, remaining;
     
-    return found_id;
+    deadline = get_time_us() + (long long)timeout * 1000;
+    while( 1 )
+    {
+		if( id != 0 ? readFrameId( handle, id, &msg ) : readFrame( handle, &msg ) )
+		{
+			trace_received( &msg );
+			*(data+0) = msg.data[0];
+			*(data+1) = msg.data[1];
+			*(data+2) = msg.data[2];
+			*(data+3) = msg.data[3];
+			*(data+4) = msg.data[4];
+			*(data+5) = msg.data[5];
+			*(data+6) = msg.data[6];
+			*(data+7) = msg.data[7];
+			return msg.id;
+		}
+
+        remaining = deadline - get_time_us();
+        if( remaining <= 0 )
+            return 0;
+        if( id != 0 ) waitForFrameId( handle, id, (long)remaining );
+        else waitForFrame( handle, (long)remaining );
+    }
+}
+
+/* Look up a header field of the loaded binary, see indexHeader() */
+int get_header_field_string(const unsigned char *bin, unsigned char id, unsigned char *answer)
+{
+    return getHeaderField( &write_header, bin, id, answer );
 }
 
+/* Remove the header fields below 0x92 from the loaded binary */
 int strip_header_field(unsigned char *bin)
 {
-     unsigned char byte, length_field, id_field;
-     unsigned char data[255];
-     unsigned int addr;
-     int i;
+    return stripHeader( &write_header, bin );
+}
+
+/* Settings of the E option, E[,image=file][,bitrate=..][,latency=..][,erase=..][,block=..] */
+int parse_sim_option( char *arg )
+{
+    char *field;
 
-     addr = 0x7FFFF;
-     
-    /* Reads backwards from the end of the binary */
-    while( addr > 0x7FD00 )
+    for( field = strtok( arg + 1, "," ); field != NULL; field = strtok( NULL, "," ) )
     {
-        /* The first byte is the length of the data */
-        length_field = *(bin+addr);
-        if( length_field == 0x00 || length_field == 0xFF ) break;
-        addr--;
-        
-        /* Second byte is an ID field */
-        id_field = *(bin+addr);
-        addr--;
+        if( strncmp( field, "image=", 6 ) == 0 ) sim_image = field + 6;
+        else if( strncmp( field, "bitrate=", 8 ) == 0 ) sim_config.bitrate = atol( field + 8 );
+        else if( strncmp( field, "latency=", 8 ) == 0 ) sim_config.latency_us = atol( field + 8 );
+        else if( strncmp( field, "erase=", 6 ) == 0 ) sim_config.erase_ms = atol( field + 6 );
+        else if( strncmp( field, "block=", 6 ) == 0 ) sim_config.max_read_block = strtol( field + 6, NULL, 0 );
+        else return -1;
+    }
+    if( sim_config.bitrate <= 0 || sim_config.latency_us < 0 || sim_config.erase_ms < 0 ) return -1;
+    // A 0x21 reply carries the block plus two bytes in its one byte length
+    if( sim_config.max_read_block < 1 || sim_config.max_read_block > READ_BLOCK_MAX ) return -1;
+    return 0;
+}
+
+long gettickscount()
+{
+	return (long)( get_time_us() / 1000 );
+}
+
+/* Microseconds from a clock that never steps, for timing only */
+long long get_time_us()
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+
+    if( timebase.denom == 0 ) mach_timebase_info( &timebase );
+    return (long long)( mach_absolute_time() / 1000 * timebase.numer / timebase.denom );
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+/* Count frames going out during a benchmark phase, a 0x240 request
+   starts the clock for the request -> response latency */
+void bench_sent( const CANMsg *msgs, int count )
+{
+    int i;
+
+    if( bench_phase == NULL ) return;
+    bench_phase->frames_sent += count;
+    for( i = 0; i < count; i++ )
+    {
+        if( msgs[i].id == 0x240 && bench_request_us == 0 ) bench_request_us = get_time_us();
+    }
+}
+
+/* Count frames coming in, the first 0x258 after a request stops the clock */
+void bench_received( const CANMsg *msg )
+{
+    if( bench_phase == NULL ) return;
+    bench_phase->frames_received++;
+    if( msg->id == 0x258 && bench_request_us != 0 )
+    {
+        if( bench_phase->requests < BENCH_MAX_SAMPLES )
+        {
+            bench_phase->latency_us[bench_phase->requests] = (int)( get_time_us() - bench_request_us );
+        }
+        bench_phase->requests++;
+        bench_request_us = 0;
+    }
+}
+
+static ID_STATS *find_id_stats( int id )
+{
+    int i;
+
+    for( i = 0; i < STATS_IDS; i++ )
+    {
+        if( id_stats[i].id == id ) return &id_stats[i];
+    }
+    return NULL;
+}
+
+/* Every frame handed to the adapter passes here, for the benchmark and
+   the I option. Returns straight away when neither is active. */
+void trace_sent( const CANMsg *msgs, int count )
+{
+    ID_STATS *stats;
+    int i;
+
+    if( bench_phase == NULL && !instrument ) return;
+    bench_sent( msgs, count );
+    if( !instrument || count == 0 ) return;
+
+    for( i = 0; i < count; i++ )
+    {
+        if( ( stats = find_id_stats( msgs[i].id ) ) != NULL ) stats->frames++;
+    }
+    stats_sent_id = find_id_stats( msgs[count-1].id );
+    stats_sent_us = get_time_us();
+}
+
+/* Every frame read from the adapter passes here, a response from the
+   Trionic stops the clock started by the last frame sent */
+void trace_received( const CANMsg *msg )
+{
+    ID_STATS *stats;
+    long long latency, age;
+
+    if( bench_phase == NULL && !instrument ) return;
+    bench_received( msg );
+    if( !instrument || ( stats = find_id_stats( msg->id ) ) == NULL ) return;
+
+    stats->frames++;
+    if( ( msg->id == 0x258 || msg->id == 0x238 ) && stats_sent_us != 0 )
+    {
+        latency = get_time_us() - stats_sent_us;
+        recordHistogram( &stats->latency, latency );
+        if( stats_sent_id != NULL ) recordHistogram( &stats_sent_id->latency, latency );
 
-        //if( id_field == 0xFE )
-        if( id_field == 0x92 )
+        /* The adapter's timestamp splits it at the moment the response
+           was on the bus */
+        age = adapterAgeUs( msg );
+        if( age >= 0 )
         {
-            // remove rest of the header leaving the 0xFE id field the last one
-            addr -= length_field;
-            while( addr > 0x7FD00 )
+            if( age > latency ) age = latency;
+            recordHistogram( &stats->to_bus, latency - age );
+            recordHistogram( &stats->from_bus, age );
+            if( stats_sent_id != NULL )
             {
-                *(bin+addr) = 0xFF;
-                addr--;
+                recordHistogram( &stats_sent_id->to_bus, latency - age );
+                recordHistogram( &stats_sent_id->from_bus, age );
             }
-            return 1;
         }
-        /* The actual data */
-        addr -= length_field;
+        stats_sent_us = 0;
+    }
+}
+
+void trace_retry( int id )
+{
+    ID_STATS *stats;
+
+    if( instrument && ( stats = find_id_stats( id ) ) != NULL ) stats->retries++;
+}
+
+static void dump_histogram( const char *name, const CANUSB_HISTOGRAM *hist )
+{
+    fprintf( log_output, "%-10s %8lu %8lu %8lu %8lu %8lu %8lu %10.1f\n", name, hist->count,
+             histogramPercentile( hist, 50.0 ), histogramPercentile( hist, 90.0 ),
+             histogramPercentile( hist, 99.0 ), histogramPercentile( hist, 99.9 ),
+             hist->max, hist->count ? hist->sum / hist->count : 0.0 );
+}
+
+/* Write the statistics gathered since the last dump to the log and
+   start over */
+void dump_stats( const char *phase )
+{
+    CANUSB_STATS *adapter = getStats();
+    char name[16];
+    int i;
+
+    if( !instrument ) return;
+
+    fprintf( log_output, "\nStatistics%s%s\n", phase ? " for " : "", phase ? phase : "" );
+    fprintf( log_output, "id           frames  retries\n" );
+    for( i = 0; i < STATS_IDS; i++ )
+    {
+        fprintf( log_output, "0x%03X      %8ld %8ld\n", id_stats[i].id, id_stats[i].frames, id_stats[i].retries );
+    }
+    fprintf( log_output, "\nlatency us    count      p50      p90      p99    p99.9      max       mean\n" );
+    for( i = 0; i < STATS_IDS; i++ )
+    {
+        if( id_stats[i].latency.count == 0 ) continue;
+        sprintf( name, "0x%03X", id_stats[i].id );
+        dump_histogram( name, &id_stats[i].latency );
+    }
+    fprintf( log_output, "\nto bus us     count      p50      p90      p99    p99.9      max       mean\n" );
+    for( i = 0; i < STATS_IDS; i++ )
+    {
+        if( id_stats[i].to_bus.count == 0 ) continue;
+        sprintf( name, "0x%03X", id_stats[i].id );
+        dump_histogram( name, &id_stats[i].to_bus );
+    }
+    fprintf( log_output, "\nfrom bus us   count      p50      p90      p99    p99.9      max       mean\n" );
+    for( i = 0; i < STATS_IDS; i++ )
+    {
+        if( id_stats[i].from_bus.count == 0 ) continue;
+        sprintf( name, "0x%03X", id_stats[i].id );
+        dump_histogram( name, &id_stats[i].from_bus );
+    }
+    fprintf( log_output, "\nreceive       count      p50      p90      p99    p99.9      max       mean\n" );
+    dump_histogram( "read bytes", &adapter->read_size );
+    dump_histogram( "queued", &adapter->queue_depth );
+    dump_histogram( "usb us", &adapter->usb_delay );
+    fprintf( log_output, "dropped    %8lu\n", adapter->dropped );
+
+    for( i = 0; i < STATS_IDS; i++ )
+    {
+        id_stats[i].frames = 0;
+        id_stats[i].retries = 0;
+        memset( &id_stats[i].latency, 0, sizeof( CANUSB_HISTOGRAM ) );
+        memset( &id_stats[i].to_bus, 0, sizeof( CANUSB_HISTOGRAM ) );
+        memset( &id_stats[i].from_bus, 0, sizeof( CANUSB_HISTOGRAM ) );
+    }
+    stats_sent_us = 0;
+    resetStats();
+}
+
+static int compare_int( const void *a, const void *b )
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Latency at the given percentile of a phase, 0 without samples */
+static int bench_percentile( BENCH_PHASE *phase, int percentile )
+{
+    int n = phase->requests < BENCH_MAX_SAMPLES ? phase->requests : BENCH_MAX_SAMPLES;
+
+    if( n == 0 ) return 0;
+    return phase->latency_us[( n - 1 ) * percentile / 100];
+}
+
+/* Time header queries, a full read, the erase and writing back what was
+   read, and save the results as JSON to filename. The flash is only
+   erased after it has been read completely. */
+int run_benchmark( CANHANDLE handle, const char *filename )
+{
+    static BENCH_PHASE phases[BENCH_PHASES];
+    const unsigned char header_ids[] = { 0x90, 0x91, 0x94, 0x95, 0x97, 0x92, 0x98, 0x99 };
+    unsigned char answer[256];
+    BENCH_PHASE *phase;
+    FILE *json;
+    long long start_us;
+    double seconds;
+    int i, k, n, ret;
+
+    memset( phases, 0, sizeof( phases ) );
+    phases[0].name = "header";
+    phases[1].name = "read";
+    phases[2].name = "erase";
+    phases[3].name = "program";
+    ret = 0;
+
+    for( n = 0; n < BENCH_PHASES && ret == 0; n++ )
+    {
+        phase = bench_phase = &phases[n];
+        bench_request_us = 0;
+        printf("Benchmark %s...", phase->name);
+        fprintf( log_output, "Benchmark %s...", phase->name);
+        start_us = get_time_us();
+        switch( n )
+        {
+            case 0:
+                for( k = 0; k < BENCH_HEADER_ROUNDS; k++ )
+                {
+                    for( i = 0; i < (int)sizeof( header_ids ); i++ )
+                    {
+                        answer[0] = 0x00;
+                        ask_header( handle, header_ids[i], answer );
+                        phase->bytes += strlen( answer );
+                    }
+                }
+                phase->ok = phase->bytes > 0;
+                break;
+            case 1:
+                phase->bytes = read_trionic( handle, 0x0, 0x80000, &read_image );
+                phase->ok = ( phase->bytes == 0x80000 );
+                break;
+            case 2:
+                phase->ok = ( erase_trionic( handle ) == 0 );
+                break;
+            case 3:
+                // Raw write of what was read leaves the Trionic as it was
+                phase->ok = ( program_trionic( handle, read_binary, NULL, NULL, NULL ) == 0 );
+                phase->bytes = phase->ok ? 0x7B000 + 0x100 : 0;
+                break;
+        }
+        phase->duration_us = get_time_us() - start_us;
+        bench_phase = NULL;
+        dump_stats( phase->name );
+
+        qsort( phase->latency_us, phase->requests < BENCH_MAX_SAMPLES ? phase->requests : BENCH_MAX_SAMPLES,
+               sizeof( int ), compare_int );
+        printf(" %s (%.2f s)\n", phase->ok ? "ok" : "failed", (double)phase->duration_us / 1000000.0);
+        fprintf( log_output, " %s (%.2f s)\n", phase->ok ? "ok" : "failed", (double)phase->duration_us / 1000000.0);
+        if( !phase->ok ) ret = -1;
+    }
+
+    printf("\nPhase        bytes/s   frames/s  requests  p50 us  p99 us\n");
+    fprintf( log_output, "\nPhase        bytes/s   frames/s  requests  p50 us  p99 us\n");
+    for( i = 0; i < n; i++ )
+    {
+        phase = &phases[i];
+        seconds = phase->duration_us > 0 ? (double)phase->duration_us / 1000000.0 : 1.0;
+        printf("%-8s %11.0f %10.0f %9d %7d %7d\n", phase->name, phase->bytes / seconds,
+               ( phase->frames_sent + phase->frames_received ) / seconds, phase->requests,
+               bench_percentile( phase, 50 ), bench_percentile( phase, 99 ) );
+        fprintf( log_output, "%-8s %11.0f %10.0f %9d %7d %7d\n", phase->name, phase->bytes / seconds,
+                 ( phase->frames_sent + phase->frames_received ) / seconds, phase->requests,
+                 bench_percentile( phase, 50 ), bench_percentile( phase, 99 ) );
+    }
+
+    json = fopen( filename, "w" );
+    if( json == NULL )
+    {
+        printf("Error: could not open file %s!\n", filename);
+        fprintf( log_output, "Error: could not open file %s!\n", filename);
+        return -1;
+    }
+    fprintf( json, "{\n  \"version\": \"%s\",\n", RELEASE_VERSION );
+    if( simulate )
+    {
+        fprintf( json, "  \"transport\": \"simulator\",\n  \"bitrate\": %ld,\n  \"latency_us\": %ld,\n",
+                 sim_config.bitrate, sim_config.latency_us );
+    }
+    else
+    {
+        fprintf( json, "  \"transport\": \"canusb\",\n" );
+    }
+    fprintf( json, "  \"read_block_size\": %d,\n  \"phases\": [\n", read_block_size );
+    for( i = 0; i < n; i++ )
+    {
+        phase = &phases[i];
+        seconds = phase->duration_us > 0 ? (double)phase->duration_us / 1000000.0 : 1.0;
+        fprintf( json, "    { \"name\": \"%s\", \"ok\": %s, \"duration_us\": %lld, \"bytes\": %ld, "
+                       "\"frames_sent\": %ld, \"frames_received\": %ld, \"bytes_per_s\": %.1f, "
+                       "\"frames_per_s\": %.1f, \"requests\": %d, \"latency_p50_us\": %d, "
+                       "\"latency_p99_us\": %d }%s\n",
+                 phase->name, phase->ok ? "true" : "false", phase->duration_us, phase->bytes,
+                 phase->frames_sent, phase->frames_received, phase->bytes / seconds,
+                 ( phase->frames_sent + phase->frames_received ) / seconds, phase->requests,
+                 bench_percentile( phase, 50 ), bench_percentile( phase, 99 ), i + 1 < n ? "," : "" );
+    }
+    fprintf( json, "  ]\n}\n" );
+    fclose( json );
+
+    return ret;
+}
+
+/* Show the CANUSBs that can be given to U or used in a jobs file */
+int list_adapters()
+{
+    CANUSB_ADAPTER adapters[MAX_JOBS];
+    int n, i;
+
+    initializeCanUsb();
+    n = listAdapters( adapters, MAX_JOBS );
+    if( n == 0 )
+    {
+        printf("No CANUSB found.\n");
+        return -1;
+    }
+    for( i = 0; i < n; i++ )
+    {
+        printf("%-16s %s%s\n", adapters[i].serial, adapters[i].description,
+               adapters[i].in_use ? " (in use)" : "");
     }
-    
     return 0;
 }
 
-long gettickscount()
+/* Run every job of a jobs file. Jobs on different adapters run at the
+   same time, each in a worker process; jobs on the same adapter run one
+   after the other in file order. Only simulated jobs, those with the E
+   option, need no adapter; "-" as serial is the first CANUSB. */
+int run_jobs( const char *filename, char *program )
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	long ticks = now.tv_sec * 1000l;
-	ticks += now.tv_usec / 1000l;
-	return ticks;
+    static JOB jobs[MAX_JOBS];
+    FILE *f;
+    char line[256], data[512];
+    fd_set fds;
+    struct timeval timeout;
+    int n, done, failed, program_any, max_fd, i, k, len, status;
+
+    f = fopen( filename, "r" );
+    if( f == NULL )
+    {
+        printf("Error: could not open file %s!\n", filename);
+        return -1;
+    }
+    n = 0;
+    program_any = 0;
+    while( fgets( line, sizeof(line), f ) != NULL )
+    {
+        if( n == MAX_JOBS )
+        {
+            printf("Error: more than %d jobs in %s\n", MAX_JOBS, filename);
+            fclose( f );
+            return -1;
+        }
+        i = parse_job( &jobs[n], line, program );
+        if( i < 0 )
+        {
+            printf("Error: bad job in %s: %s", filename, line);
+            fclose( f );
+            return -1;
+        }
+        if( i == 0 ) continue;
+
+        /* Same test as run_session(), the benchmark only programs for real */
+        k = toupper( (unsigned char)*jobs[n].args[1] );
+        if( k == 'W' || k == 'A' || k == 'T' || ( k == 'B' && !jobs[n].simulated ) )
+            program_any = 1;
+        n++;
+    }
+    fclose( f );
+    if( n == 0 )
+    {
+        printf("Error: no jobs in %s\n", filename);
+        return -1;
+    }
+
+    /* Ask once for all of them, the workers cannot ask */
+    if( program_any )
+    {
+        if( !confirm_programming() )
+        {
+            printf("Aborted, nothing done.\n");
+            return 0;
+        }
+        confirmed = 1;
+    }
+
+    done = 0;
+    show_jobs( jobs, n, 0 );
+    while( done < n )
+    {
+        for( i = 0; i < n; i++ )
+        {
+            if( jobs[i].pid != 0 ) continue;
+            for( k = 0; k < i; k++ )
+            {
+                /* An earlier job on the same adapter is not done yet */
+                if( jobs[k].pid != -1 && !jobs[k].simulated && !jobs[i].simulated &&
+                    strcmp( jobs[k].serial, jobs[i].serial ) == 0 ) break;
+            }
+            if( k == i )
+            {
+                start_job( &jobs[i] );
+                if( jobs[i].pid == -1 ) done++;
+            }
+        }
+
+        FD_ZERO( &fds );
+        max_fd = -1;
+        for( i = 0; i < n; i++ )
+        {
+            if( jobs[i].pid > 0 )
+            {
+                FD_SET( jobs[i].fd, &fds );
+                if( jobs[i].fd > max_fd ) max_fd = jobs[i].fd;
+            }
+        }
+        timeout.tv_sec = 0;
+        timeout.tv_usec = JOB_REFRESH_MS * 1000;
+        if( max_fd >= 0 && select( max_fd + 1, &fds, NULL, NULL, &timeout ) > 0 )
+        {
+            for( i = 0; i < n; i++ )
+            {
+                if( jobs[i].pid <= 0 || !FD_ISSET( jobs[i].fd, &fds ) ) continue;
+                len = read( jobs[i].fd, data, sizeof(data) );
+                if( len > 0 )
+                {
+                    job_output( &jobs[i], data, len );
+                    continue;
+                }
+
+                /* The worker closed its stdout, it is finishing */
+                close( jobs[i].fd );
+                waitpid( jobs[i].pid, &status, 0 );
+                jobs[i].result = ( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 ) ? 0 : -1;
+                jobs[i].pid = -1;
+                done++;
+            }
+        }
+        show_jobs( jobs, n, 1 );
+    }
+
+    failed = 0;
+    printf("\n");
+    for( i = 0; i < n; i++ )
+    {
+        printf("%-16s %s %s: %s\n", jobs[i].serial, jobs[i].args[1], jobs[i].args[jobs[i].nargs - 1],
+               jobs[i].result == 0 ? "ok" : "failed" );
+        if( jobs[i].result != 0 ) failed++;
+    }
+    return failed ? -1 : 0;
+}
+
+/* Split a jobs file line into serial and arguments. Returns 1 for a
+   job, 0 for an empty line or a # comment and -1 if it is not valid. */
+int parse_job( JOB *job, const char *line, char *program )
+{
+    char *token;
+    int i;
+
+    memset( job, 0, sizeof(JOB) );
+    strncpy( job->line, line, sizeof(job->line) - 1 );
+    token = strtok( job->line, " \t\r\n" );
+    if( token == NULL || *token == '#' ) return 0;
+
+    job->serial = token;
+    job->args[0] = program;
+    job->nargs = 1;
+    while( ( token = strtok( NULL, " \t\r\n" ) ) != NULL )
+    {
+        if( job->nargs == JOB_MAX_ARGS + 1 ) return -1;
+        job->args[job->nargs++] = token;
+    }
+    job->args[job->nargs] = NULL;
+
+    /* Needs at least the operation and the file */
+    if( job->nargs < 3 || strchr( "RrWwAaTtBb", *job->args[1] ) == NULL ) return -1;
+
+    /* Options sit between the operation and the file, see parse_options() */
+    for( i = 2; i < job->nargs - 1; i++ )
+    {
+        if( *job->args[i] == 'E' || *job->args[i] == 'e' ) job->simulated = 1;
+    }
+    job->result = -1;
+    strcpy( job->status, "waiting" );
+    return 1;
+}
+
+/* Fork the worker of a job with its stdout going into a pipe */
+void start_job( JOB *job )
+{
+    int pipe_fds[2];
+
+    fflush( stdout );
+    if( pipe( pipe_fds ) != 0 )
+    {
+        strcpy( job->status, "no pipe for the worker" );
+        job->pid = -1;
+        return;
+    }
+
+    job->pid = fork();
+    if( job->pid == 0 )
+    {
+        close( pipe_fds[0] );
+        dup2( pipe_fds[1], STDOUT_FILENO );
+        close( pipe_fds[1] );
+        setvbuf( stdout, NULL, _IONBF, 0 );
+        freopen( "/dev/null", "r", stdin );
+        if( strcmp( job->serial, "-" ) != 0 ) adapter_serial = job->serial;
+        exit( run_session( job->nargs, job->args ) == 0 ? 0 : 1 );
+    }
+
+    close( pipe_fds[1] );
+    if( job->pid < 0 )
+    {
+        close( pipe_fds[0] );
+        strcpy( job->status, "could not start the worker" );
+        job->pid = -1;
+        return;
+    }
+    job->fd = pipe_fds[0];
+    strcpy( job->status, "started" );
+}
+
+/* Pick the progress and the latest message out of a worker's output.
+   Progress is printed as "xx.x % done", often without a line break. */
+void job_output( JOB *job, const char *data, int len )
+{
+    char *p, *last;
+    int i, end;
+
+    for( i = 0; i < len; i++ )
+    {
+        end = data[i] == '\n' || data[i] == '\r';
+        if( !end ) job->out[job->out_len++] = data[i];
+        if( !end && job->out_len < (int)sizeof(job->out) - 1 &&
+            !( job->out_len >= 6 && memcmp( job->out + job->out_len - 6, "% done", 6 ) == 0 ) ) continue;
+
+        job->out[job->out_len] = 0;
+        job->out_len = 0;
+
+        last = NULL;
+        for( p = strstr( job->out, "% done" ); p != NULL; p = strstr( p + 1, "% done" ) ) last = p;
+        if( last != NULL )
+        {
+            while( last > job->out && ( isdigit( (unsigned char)last[-1] ) || last[-1] == '.' || last[-1] == ' ' ) ) last--;
+            job->percent = atof( last );
+        }
+        else if( job->out[0] != 0 )
+        {
+            strncpy( job->status, job->out, sizeof(job->status) - 1 );
+            job->status[sizeof(job->status) - 1] = 0;
+        }
+    }
+}
+
+/* One line per job, redrawn in place on a terminal. Elsewhere only the
+   finished jobs are printed, once. */
+void show_jobs( JOB *jobs, int n, int redraw )
+{
+    static int shown[MAX_JOBS];
+    int tty, i;
+
+    tty = isatty( STDOUT_FILENO );
+    if( tty && redraw ) printf("%c[%dA", ESC, n );
+    for( i = 0; i < n; i++ )
+    {
+        if( !tty && ( jobs[i].pid != -1 || shown[i] ) ) continue;
+        shown[i] = 1;
+        printf("%-16s %s %-24.24s %5.1f %%  %-32.32s", jobs[i].serial, jobs[i].args[1],
+               jobs[i].args[jobs[i].nargs - 1], jobs[i].percent,
+               jobs[i].pid == -1 ? ( jobs[i].result == 0 ? "done" : jobs[i].status ) : jobs[i].status );
+        if( tty ) printf("%c[K", ESC );
+        printf("\n");
+    }
+    fflush( stdout );
+}
+
+/* Forget what the previous session learned about its Trionic, the
+   daemon runs one after the other in the same process */
+void reset_session()
+{
+    int i, id;
+
+    closeImage( &write_image );
+    closeImage( &read_image );
+    binary = NULL;
+    read_binary = NULL;
+    binary_length = 0;
+    pace_gap_us = 0;
+    pace_good_blocks = 0;
+    pace_backoffs = 0;
+    setTxBurst( CANUSB_TX_BURST_DEFAULT );
+    skip_erased = 0;
+    read_block_size = READ_BLOCK_MAX;
+    bench_phase = NULL;
+    bench_request_us = 0;
+    for( i = 0; i < STATS_IDS; i++ )
+    {
+        id = id_stats[i].id;
+        memset( &id_stats[i], 0, sizeof(ID_STATS) );
+        id_stats[i].id = id;
+    }
+    stats_sent_id = NULL;
+    stats_sent_us = 0;
+    resetStats();
+    instrument = daemon_instrument;
+    enableStats( instrument ? TRUE : FALSE );
+}
+
+void stop_daemon( int signal_number )
+{
+    (void)signal_number;
+    daemon_stop = 1;
+}
+
+/* Non-zero if a job leaves the bus alone. The daemon's bus is opened
+   once at startup, a job cannot switch to the simulator or another
+   adapter with E or U. */
+int daemon_job_options( const JOB *job )
+{
+    int i;
+
+    for( i = 2; i < job->nargs - 1; i++ )
+    {
+        if( strchr( "EeUu", *job->args[i] ) != NULL ) return 0;
+    }
+    return 1;
+}
+
+/* Keep the adapter open and run the jobs dropped into a spool directory
+   back to back. A job is a file named *.job holding one line as in a
+   jobs file, the serial in it is not looked at. It is renamed to *.run
+   while it runs and to *.ok or *.failed when done, the session log goes
+   next to the binary as usual. Jobs run in name order. */
+int run_daemon( int argc, char *argv[] )
+{
+    const char *spool = argv[argc-1];
+    char name[256], path[512], claimed[512], line[256];
+    FT_HANDLE h = NULL;
+    FILE *daemon_log, *f;
+    DIR *dir;
+    struct dirent *entry;
+    JOB job;
+    int len, ok, parsed;
+
+    snprintf( path, sizeof(path), "%s/daemon.log", spool );
+    daemon_log = fopen( path, "a" );
+    if( daemon_log == NULL )
+    {
+        printf("Error: could not open file %s!\n", path);
+        return -1;
+    }
+    log_output = daemon_log;
+    if( parse_options( argc, argv ) != 0 || open_bus( &h ) != 0 )
+    {
+        fclose( daemon_log );
+        return -1;
+    }
+    bus_open = 1;
+    bus_handle = h;
+    daemon_instrument = instrument;
+    confirmed = 1;                      /* dropping a job in is the confirmation */
+    signal( SIGINT, stop_daemon );
+    signal( SIGTERM, stop_daemon );
+
+    printf("Waiting for jobs in %s\n", spool);
+    fprintf( daemon_log, "Waiting for jobs in %s\n", spool);
+    fflush( daemon_log );
+    while( !daemon_stop )
+    {
+        name[0] = 0;
+        dir = opendir( spool );
+        if( dir == NULL )
+        {
+            printf("Error: could not read %s!\n", spool);
+            fprintf( daemon_log, "Error: could not read %s!\n", spool);
+            break;
+        }
+        while( ( entry = readdir( dir ) ) != NULL )
+        {
+            len = strlen( entry->d_name );
+            if( len > 4 && len < (int)sizeof(name) && strcmp( entry->d_name + len - 4, ".job" ) == 0 &&
+                ( name[0] == 0 || strcmp( entry->d_name, name ) < 0 ) )
+                strcpy( name, entry->d_name );
+        }
+        closedir( dir );
+        if( name[0] == 0 )
+        {
+            usleep( SPOOL_POLL_MS * 1000 );
+            continue;
+        }
+
+        // Claim it, so a second daemon on the same spool skips it
+        name[strlen( name ) - 4] = 0;
+        snprintf( path, sizeof(path), "%s/%s.job", spool, name );
+        snprintf( claimed, sizeof(claimed), "%s/%s.run", spool, name );
+        if( rename( path, claimed ) != 0 ) continue;
+
+        line[0] = 0;
+        f = fopen( claimed, "r" );
+        if( f != NULL )
+        {
+            if( fgets( line, sizeof(line), f ) == NULL ) line[0] = 0;
+            fclose( f );
+        }
+
+        ok = 0;
+        parsed = parse_job( &job, line, argv[0] ) == 1;
+        if( parsed && !daemon_job_options( &job ) )
+        {
+            printf("Job %s: E and U are set when the daemon starts\n", name);
+            fprintf( daemon_log, "Job %s: E and U are set when the daemon starts\n", name);
+        }
+        else if( parsed )
+        {
+            printf("\nJob %s: %s", name, line);
+            fprintf( daemon_log, "Job %s: %s", name, line);
+            fflush( daemon_log );
+            ok = run_session( job.nargs, job.args ) == 0;
+            log_output = daemon_log;
+        }
+        snprintf( path, sizeof(path), "%s/%s.%s", spool, name, ok ? "ok" : "failed" );
+        rename( claimed, path );
+        printf("Job %s %s\n", name, ok ? "done" : "failed");
+        fprintf( daemon_log, "Job %s %s\n", name, ok ? "done" : "failed");
+        fflush( daemon_log );
+    }
+
+    bus_open = 0;
+    FT_Purge(h, FT_PURGE_RX | FT_PURGE_TX);
+    release_bus( h );
+    fclose( daemon_log );
+    return 0;
+}
+/* Add path to the list if it is a binary, or every binary under it if it
+   is a directory. Files named on the command line are taken whatever
+   their name; symbolic links are not followed. */
+int collect_images( const char *path, int named, char ***paths, int *n, int *max )
+{
+    char child[1024];
+    struct stat st;
+    struct dirent *entry;
+    DIR *dir;
+    size_t len;
+    char **grown;
+
+    if( lstat( path, &st ) != 0 ) return -1;
+    if( S_ISDIR( st.st_mode ) )
+    {
+        dir = opendir( path );
+        if( dir == NULL ) return -1;
+        while( ( entry = readdir( dir ) ) != NULL )
+        {
+            if( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 ) continue;
+            snprintf( child, sizeof(child), "%s/%s", path, entry->d_name );
+            collect_images( child, 0, paths, n, max );
+        }
+        closedir( dir );
+        return 0;
+    }
+    len = strlen( path );
+    if( !S_ISREG( st.st_mode ) || ( !named && ( len < 4 || strcasecmp( path + len - 4, ".bin" ) != 0 ) ) )
+        return 0;
+
+    if( *n == *max )
+    {
+        *max = *max ? *max * 2 : 256;
+        grown = realloc( *paths, *max * sizeof(char *) );
+        if( grown == NULL ) return -1;
+        *paths = grown;
+    }
+    (*paths)[(*n)++] = strdup( path );
+    return 0;
+}
+
+static int compare_path( const void *a, const void *b )
+{
+    return strcmp( *(char * const *)a, *(char * const *)b );
+}
+
+static void catalog_field( unsigned char id, char *field, int size )
+{
+    unsigned char buf[256];
+
+    if( get_header_field_string( binary, id, buf ) ) snprintf( field, size, "%.*s", size - 1, buf );
+}
+
+/* Read the header fields of one binary the same way a write does */
+int catalog_image( const char *path, CATALOG_ENTRY *entry )
+{
+    struct stat st;
+    int ret = -1;
+
+    memset( entry, 0, sizeof(CATALOG_ENTRY) );
+    if( stat( path, &st ) == 0 )
+    {
+        entry->mtime = st.st_mtime;
+        entry->size = st.st_size;
+    }
+    entry->flags = CATALOG_BAD;
+    if( load_file( path, &write_image ) == 0 && write_scan.signature )
+    {
+        entry->flags = ( write_scan.motorola ? CATALOG_MOTOROLA : 0 ) |
+                       ( binary_length == 0x70100 ? CATALOG_TIS : 0 );
+        entry->checksum = write_scan.checksum;
+        catalog_field( 0x90, entry->vin, sizeof(entry->vin) );
+        catalog_field( 0x91, entry->hw, sizeof(entry->hw) );
+        catalog_field( 0x94, entry->sw, sizeof(entry->sw) );
+        catalog_field( 0x95, entry->version, sizeof(entry->version) );
+        catalog_field( 0x97, entry->engine, sizeof(entry->engine) );
+        catalog_field( 0x98, entry->tester, sizeof(entry->tester) );
+        catalog_field( 0x99, entry->date, sizeof(entry->date) );
+        ret = 0;
+    }
+    closeImage( &write_image );
+    binary = NULL;
+    return ret;
+}
+
+/* Build or refresh the catalog argv[2] from the binaries under argv[3...].
+   A binary whose size and time are those in the old catalog keeps its
+   entry, the others are read by one worker process per core. Each worker
+   sends back whole entries through one pipe; they are smaller than
+   PIPE_BUF so the writes of different workers never mix. */
+int build_catalog( int argc, char *argv[] )
+{
+    const char *filename = argv[2];
+    CATALOG old;
+    const CATALOG_ENTRY *kept;
+    CATALOG_ENTRY *entries, entry;
+    char **paths = NULL;
+    int *todo;
+    pid_t pids[CATALOG_MAX_WORKERS];
+    struct stat st;
+    long long start_us;
+    int n, max, ntodo, workers, received, bad, i, k, len, got, status, ret;
+    int pipe_fds[2];
+
+    start_us = get_time_us();
+    n = max = 0;
+    for( i = 3; i < argc; i++ )
+    {
+        if( collect_images( argv[i], 1, &paths, &n, &max ) != 0 )
+        {
+            printf("Error: could not read %s!\n", argv[i]);
+            return -1;
+        }
+    }
+    if( n > 0 ) qsort( paths, n, sizeof(char *), compare_path );
+
+    entries = calloc( n + 1, sizeof(CATALOG_ENTRY) );
+    todo = malloc( ( n + 1 ) * sizeof(int) );
+    if( entries == NULL || todo == NULL )
+    {
+        printf("Error: out of memory!\n");
+        return -1;
+    }
+
+    // No catalog yet, or one from another build, just means reading everything
+    openCatalog( &old, filename );
+    ntodo = 0;
+    for( i = 0; i < n; i++ )
+    {
+        kept = findCatalogPath( &old, paths[i] );
+        if( kept != NULL && stat( paths[i], &st ) == 0 &&
+            kept->mtime == (long long)st.st_mtime && kept->size == (long long)st.st_size )
+            entries[i] = *kept;
+        else
+            todo[ntodo++] = i;
+    }
+    closeCatalog( &old );
+
+    workers = (int)sysconf( _SC_NPROCESSORS_ONLN );
+    if( workers < 1 ) workers = 1;
+    if( workers > CATALOG_MAX_WORKERS ) workers = CATALOG_MAX_WORKERS;
+    if( workers > ntodo ) workers = ntodo;
+    if( workers > 0 && pipe( pipe_fds ) != 0 )
+    {
+        printf("Error: no pipe for the workers!\n");
+        return -1;
+    }
+
+    fflush( stdout );
+    for( k = 0; k < workers; k++ )
+    {
+        pids[k] = fork();
+        if( pids[k] == 0 )
+        {
+            close( pipe_fds[0] );
+            freopen( "/dev/null", "w", stdout );
+            log_output = fopen( "/dev/null", "w" );
+            for( i = k; i < ntodo; i += workers )
+            {
+                catalog_image( paths[todo[i]], &entry );
+                entry.file = todo[i];
+                if( write( pipe_fds[1], &entry, sizeof(entry) ) != sizeof(entry) ) exit( 1 );
+            }
+            exit( 0 );
+        }
+    }
+
+    received = 0;
+    if( workers > 0 )
+    {
+        close( pipe_fds[1] );
+        for( ;; )
+        {
+            for( got = 0; got < (int)sizeof(entry); got += len )
+            {
+                len = read( pipe_fds[0], (char *)&entry + got, sizeof(entry) - got );
+                if( len <= 0 ) break;
+            }
+            if( got < (int)sizeof(entry) ) break;
+            if( entry.file < (unsigned int)n )
+            {
+                entries[entry.file] = entry;
+                received++;
+            }
+            if( isatty( STDOUT_FILENO ) && received % 64 == 0 )
+            {
+                printf("\r%d of %d read", received, ntodo);
+                fflush( stdout );
+            }
+        }
+        close( pipe_fds[0] );
+    }
+    ret = 0;
+    for( k = 0; k < workers; k++ )
+    {
+        if( pids[k] < 0 || waitpid( pids[k], &status, 0 ) < 0 || !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+            ret = -1;
+    }
+    if( isatty( STDOUT_FILENO ) && workers > 0 ) printf("\r%c[K", ESC);
+
+    if( ret != 0 || received != ntodo )
+    {
+        printf("Error: only %d of %d binaries could be read, %s left as it was.\n", received, ntodo, filename);
+        return -1;
+    }
+    if( writeCatalog( filename, entries, n, paths ) != 0 )
+    {
+        printf("Error: could not write file %s!\n", filename);
+        return -1;
+    }
+
+    bad = 0;
+    for( i = 0; i < n; i++ )
+        if( entries[i].flags & CATALOG_BAD ) bad++;
+    printf("%d binaries, %d read, %d unchanged, %d not for a Trionic 7 (%.1f s)\n",
+           n, ntodo, n - ntodo, bad, (double)( get_time_us() - start_us ) / 1000000.0);
+
+    for( i = 0; i < n; i++ ) free( paths[i] );
+    free( paths );
+    free( entries );
+    free( todo );
+    return 0;
+}
+
+/* List the binaries in catalog argv[2] that match every query in
+   argv[3...], such as sw=5382212 or vin=YS3EF* */
+int find_catalog( int argc, char *argv[] )
+{
+    CATALOG catalog;
+    CATALOG_ENTRY blank;
+    const CATALOG_ENTRY *entry;
+    long long start_us;
+    unsigned int i;
+    int k, found, match;
+
+    start_us = get_time_us();
+    if( openCatalog( &catalog, argv[2] ) != 0 )
+    {
+        printf("Error: %s is not a catalog, build it with X first!\n", argv[2]);
+        return -1;
+    }
+    memset( &blank, 0, sizeof(blank) );
+    for( k = 3; k < argc; k++ )
+    {
+        if( matchCatalog( &blank, argv[k] ) < 0 )
+        {
+            printf("Error: unknown query %s, use vin, hw, sw, version, engine, tester or date=value\n", argv[k]);
+            closeCatalog( &catalog );
+            return -1;
+        }
+    }
+
+    found = 0;
+    for( i = 0; i < catalog.header->count; i++ )
+    {
+        entry = &catalog.entry[i];
+        if( entry->flags & CATALOG_BAD ) continue;
+        for( match = 1, k = 3; match && k < argc; k++ )
+            match = matchCatalog( entry, argv[k] ) == 1;
+        if( !match ) continue;
+        printf("%-8s %-8s %-16s %-10s %-17s %-6s %s\n", entry->sw, entry->hw, entry->version,
+               entry->engine, entry->vin, entry->date, catalogPath( &catalog, entry ));
+        found++;
+    }
+    fprintf( stderr, "%d of %u binaries (%.2f ms)\n", found, catalog.header->count,
+             (double)( get_time_us() - start_us ) / 1000.0 );
+    closeCatalog( &catalog );
+    return 0;
 }
@@ -0,0 +1,167 @@
+/*
+ *  slcan.c
+ *  saabopentechproj
+ *
+ *  Both directions go through 16 and 256 entry tables, one lookup per
+ *  hex digit and no branches on the digits themselves; an invalid digit
+ *  only sets a bit that is checked once per record.
+ *
+ */
+
+#include "slcan.h"
+
+// Set in hex_nibble for anything that is not a hex digit
+#define NOT_HEX		0x10
+
+static const char hex_digit[16] = "0123456789ABCDEF";
+
+#define X NOT_HEX
+static const unsigned char hex_nibble[256] = {
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+	X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X
+};
+#undef X
+
+// Parse digits hex digits at p. Returns 0, or -1 if any is not a hex digit.
+int slcanHex( const char *p, int digits, unsigned long *value )
+{
+	const unsigned char *q = (const unsigned char *)p;
+	unsigned long v = 0;
+	unsigned char bad = 0;
+	int i;
+
+	for ( i = 0; i < digits; i++ ) {
+		bad |= hex_nibble[q[i]];
+		v = ( v << 4 ) | ( hex_nibble[q[i]] & 0x0F );
+	}
+	*value = v;
+	return ( bad & NOT_HEX ) ? -1 : 0;
+}
+
+// Encode one frame as a record including the CR, returns its length
+// (at most SLCAN_MAX_ENCODED). A timestamp is never sent.
+int slcanEncode( char *buf, const CANMsg *msg )
+{
+	char *p = buf;
+	unsigned long id = msg->id;
+	unsigned char len;
+	int i;
+
+	if ( msg->flags & CANMSG_EXTENDED ) {
+		*p++ = ( msg->flags & CANMSG_RTR ) ? 'R' : 'T';
+		for ( i = 28; i >= 0; i -= 4 ) {
+			*p++ = hex_digit[( id >> i ) & 0x0F];
+		}
+	}
+	else {
+		*p++ = ( msg->flags & CANMSG_RTR ) ? 'r' : 't';
+		*p++ = hex_digit[( id >> 8 ) & 0x0F];
+		*p++ = hex_digit[( id >> 4 ) & 0x0F];
+		*p++ = hex_digit[id & 0x0F];
+	}
+
+	len = msg->len > 8 ? 8 : msg->len;
+	*p++ = '0' + len;
+
+	// Just dlc no data for RTR
+	if ( !( msg->flags & CANMSG_RTR ) ) {
+		for ( i = 0; i < len; i++ ) {
+			*p++ = hex_digit[msg->data[i] >> 4];
+			*p++ = hex_digit[msg->data[i] & 0x0F];
+		}
+	}
+
+	*p++ = 0x0d;
+	return p - buf;
+}
+
+// Decode a record without its CR. A frame record must be exactly as long
+// as its dlc says, or four digits longer when the adapter adds its
+// timestamp; that is then in msg->timestamp and CANMSG_TIMESTAMP is set.
+int slcanDecode( const char *line, int len, CANMsg *msg )
+{
+	const unsigned char *p = (const unsigned char *)line;
+	unsigned long value;
+	unsigned char bad;
+	int id_len;
+	int dlc;
+	int base;
+	int i;
+
+	switch ( line[0] ) {
+		case 't':
+			id_len = 3;
+			msg->flags = 0;
+			break;
+		case 'T':
+			id_len = 8;
+			msg->flags = CANMSG_EXTENDED;
+			break;
+		case 'r':
+			id_len = 3;
+			msg->flags = CANMSG_RTR;
+			break;
+		case 'R':
+			id_len = 8;
+			msg->flags = CANMSG_EXTENDED | CANMSG_RTR;
+			break;
+		default:
+			return SLCAN_NOT_FRAME;
+	}
+
+	if ( len < id_len + 2 ) {
+		return SLCAN_INVALID;
+	}
+	if ( slcanHex( line + 1, id_len, &value ) != 0 ) {
+		return SLCAN_INVALID;
+	}
+	msg->id = value;
+
+	dlc = p[id_len + 1] - '0';
+	if ( dlc < 0 || dlc > 8 ) {
+		return SLCAN_INVALID;
+	}
+	msg->len = dlc;
+
+	// Just dlc no data for RTR
+	base = id_len + 2 + ( ( msg->flags & CANMSG_RTR ) ? 0 : dlc * 2 );
+	if ( len != base && len != base + 4 ) {
+		return SLCAN_INVALID;
+	}
+
+	if ( !( msg->flags & CANMSG_RTR ) ) {
+		p += id_len + 2;
+		bad = 0;
+		for ( i = 0; i < dlc; i++, p += 2 ) {
+			bad |= hex_nibble[p[0]] | hex_nibble[p[1]];
+			msg->data[i] = ( hex_nibble[p[0]] << 4 ) | ( hex_nibble[p[1]] & 0x0F );
+		}
+		if ( bad & NOT_HEX ) {
+			return SLCAN_INVALID;
+		}
+	}
+
+	if ( len == base + 4 ) {
+		if ( slcanHex( line + base, 4, &value ) != 0 ) {
+			return SLCAN_INVALID;
+		}
+		msg->timestamp = value;
+		msg->flags |= CANMSG_TIMESTAMP;
+	}
+
+	return SLCAN_FRAME;
+}
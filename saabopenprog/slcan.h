@@ -0,0 +1,46 @@
+/*
+ *  slcan.h
+ *  saabopentechproj
+ *
+ *  Encoding and decoding of the ASCII frame records (t, T, r and R) the
+ *  CANUSB exchanges with the host. Needs nothing but the C library and
+ *  never allocates, so it can be used and measured on its own.
+ *
+ */
+
+#ifndef SLCAN_H
+#define SLCAN_H
+
+// Message flags
+#define CANMSG_EXTENDED   0x80 // Extended CAN id
+#define CANMSG_RTR        0x40 // Remote frame
+#define CANMSG_TIMESTAMP  0x20 // timestamp came with the frame
+
+// CAN Frame
+typedef struct {
+	unsigned long id;         // Message id
+	unsigned long timestamp;  // timestamp in milliseconds
+	unsigned char flags;      // [extended_id|1][RTR:1][timestamp:1][reserved:5]
+	unsigned char len;        // Frame size (0.8)
+	unsigned char data[ 8 ];  // Databytes 0..7
+} CANMsg;
+
+// Longest record we accept: T + 8 id + dlc + 16 data + 4 timestamp
+#define SLCAN_MAX_RECORD		30
+
+// Longest record slcanEncode() writes, CR included
+#define SLCAN_MAX_ENCODED		27
+
+// With timestamps on (Z1) the adapter appends the time in ms, modulo this
+#define SLCAN_TIMESTAMP_WRAP	60000
+
+// What slcanDecode() made of a record
+#define SLCAN_FRAME			1	// a frame, in msg
+#define SLCAN_NOT_FRAME		0	// some other record, e.g. a reply
+#define SLCAN_INVALID		-1	// a frame record that does not parse
+
+int slcanEncode( char *buf, const CANMsg *msg );
+int slcanDecode( const char *line, int len, CANMsg *msg );
+int slcanHex( const char *p, int digits, unsigned long *value );
+
+#endif
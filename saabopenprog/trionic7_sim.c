@@ -0,0 +1,589 @@
+/*
+ *  trionic7_sim.c
+ *  saabopentechproj
+ *
+ *  Software Trionic 7 on a simulated CAN bus, installed as the transport
+ *  of lawcel_canusb_ftd2xx so reads and writes can run without a car.
+ *
+ *  Frames are put on a single bus timeline: each one occupies the bus
+ *  for its worst case bit time at the configured bitrate, and the ECU
+ *  answers latency_us after a request or acknowledgement has been
+ *  received. A frame is handed to readFrame() once it has been
+ *  transmitted in real time, so read and program timings come out close
+ *  to what the same bitrate and turnaround give on a car.
+ *
+ */
+
+#include "trionic7_sim.h"
+#include "header_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Frames on their way to the tool
+#define SIM_RX_QUEUE		1024	// must be a power of two
+#define SIM_RX_MASK			( SIM_RX_QUEUE - 1 )
+
+// Some other module talks on the bus this often, so there is always
+// traffic to find when the channel is opened
+#define SIM_BROADCAST_US	100000
+#define SIM_BROADCAST_ID	0x1A0
+
+// Largest request or reply, the length byte limits both to 255
+#define SIM_MSG_MAX			256
+
+// The header fields live at the very end of the flash, see indexHeader()
+#define SIM_HEADER_END		( T7SIM_FLASH_SIZE - 1 )
+#define SIM_HEADER_START	( T7SIM_FLASH_SIZE - HEADER_SPAN )
+
+typedef struct {
+	CANMsg msg;
+	long long due;			// when its last bit is on the bus
+} SIM_FRAME;
+
+static T7SIM_CONFIG sim_config;
+static unsigned char flash[T7SIM_FLASH_SIZE];
+
+static SIM_FRAME sim_rx[SIM_RX_QUEUE];
+static unsigned int sim_rx_head = 0;
+static unsigned int sim_rx_tail = 0;
+static long long bus_free_us = 0;
+static long long next_broadcast_us = 0;
+
+// Request being assembled from 0x240 rows
+static unsigned char request[SIM_MSG_MAX + 8];
+static int request_len = 0;
+static int request_fill = 0;
+static BOOL request_active = FALSE;
+
+// Reply being sent on 0x258, one row per acknowledgement
+static unsigned char reply[SIM_MSG_MAX + 8];
+static int reply_len = 0;
+static int reply_pos = 0;
+static int reply_rows_left = 0;
+static unsigned char reply_last_row = 0;
+
+static BOOL authenticated = FALSE;
+static unsigned short seed = 0;
+static long long erase_end_us = 0;
+static int download_addr = 0;
+static int download_end = 0;
+static int read_addr = 0;
+static int read_len = 0;
+
+static BOOL simSend( void *context, const CANMsg *msg );
+static BOOL simReceive( void *context, CANMsg *msg );
+static BOOL simWait( void *context, long timeout_us );
+
+static const CANUSB_TRANSPORT sim_transport = { simSend, simReceive, simWait, NULL };
+
+// Fields of the default image, in the order they follow each other
+// backwards from the end of the flash
+static const struct {
+	unsigned char id;
+	const char *text;
+} default_header[] = {
+	{ 0x91, "5381981" },
+	{ 0x94, "5382212" },
+	{ 0x95, "EF4FXXXX_L.SIM" },
+	{ 0x97, "B205L" },
+	{ 0x92, "0000000000000" },
+	{ 0x90, "YS3EF48E0X3000000" },
+	{ 0x99, "071022" },
+	{ 0x98, "SAAB_OPEN_PRG" }
+};
+
+static long long simNow( void )
+{
+	struct timeval now;
+
+	gettimeofday( &now, NULL );
+	return (long long)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+// Worst case time on the bus for a standard frame, stuff bits included
+static long long frameTime( int len )
+{
+	long bits = 47 + 8 * len + ( 34 + 8 * len - 1 ) / 4;
+
+	return (long long)bits * 1000000 / sim_config.bitrate;
+}
+
+// Put a frame for the tool on the bus, no earlier than earliest
+static void scheduleFrame( const CANMsg *msg, long long earliest )
+{
+	SIM_FRAME *frame;
+	long long start = earliest > bus_free_us ? earliest : bus_free_us;
+
+	bus_free_us = start + frameTime( msg->len );
+	if ( ( sim_rx_head - sim_rx_tail ) >= SIM_RX_QUEUE ) {
+		// Nobody is reading, the adapter would overrun too
+		return;
+	}
+	frame = &sim_rx[sim_rx_head & SIM_RX_MASK];
+	frame->msg = *msg;
+	frame->msg.timestamp = ( bus_free_us / 1000 ) % SLCAN_TIMESTAMP_WRAP;
+	frame->msg.flags |= CANMSG_TIMESTAMP;	// as the adapter does with Z1
+	frame->due = bus_free_us;
+	sim_rx_head++;
+}
+
+// Generate the background traffic that is due
+static void pollBus( long long now )
+{
+	CANMsg msg;
+
+	if ( now < next_broadcast_us ) {
+		return;
+	}
+	memset( &msg, 0, sizeof( CANMsg ) );
+	msg.id = SIM_BROADCAST_ID;
+	msg.len = 8;
+	scheduleFrame( &msg, now );
+	next_broadcast_us = now + SIM_BROADCAST_US;
+}
+
+// Send the next row of the reply, the first row carries the length and
+// the first five bytes, every following row six more
+static void sendReplyRow( long long t )
+{
+	CANMsg msg;
+	int first = ( reply_pos == 0 );
+	int k;
+
+	memset( &msg, 0, sizeof( CANMsg ) );
+	msg.id = 0x258;
+	msg.len = 8;
+	msg.data[1] = 0xA1;
+	if ( first ) {
+		reply_rows_left = reply_len > 5 ? ( reply_len - 5 + 5 ) / 6 : 0;
+		msg.data[0] = 0xC0 | reply_rows_left;
+		msg.data[2] = reply_len;
+		k = 3;
+	}
+	else {
+		reply_rows_left--;
+		msg.data[0] = 0x80 | reply_rows_left;
+		k = 2;
+	}
+	for ( ; k < 8; k++ ) {
+		msg.data[k] = reply_pos < reply_len ? reply[reply_pos++] : 0x00;
+	}
+
+	reply_last_row = msg.data[0];
+	scheduleFrame( &msg, t + sim_config.latency_us );
+}
+
+static void negativeReply( unsigned char service, unsigned char code )
+{
+	reply[0] = 0x7F;
+	reply[1] = service;
+	reply[2] = code;
+	reply_len = 3;
+}
+
+// Same key as calc_auth_key() with the first method
+static unsigned short authKey( unsigned short value )
+{
+	unsigned short key;
+
+	key = value << 2;
+	key ^= 0x8142;
+	key -= 0x2356;
+	return key;
+}
+
+// Copy the last header field with this id, unterminated, the way the
+// tool itself finds it. Returns its length or -1.
+static int simFindField( unsigned char id, unsigned char *answer )
+{
+	HEADER_INDEX index;
+	const HEADER_FIELD *field;
+	int i;
+
+	indexHeader( &index, flash, T7SIM_FLASH_SIZE );
+	field = findHeaderField( &index, id );
+	if ( field == NULL ) {
+		return -1;
+	}
+	for ( i = 0; i < field->length; i++ ) {
+		answer[i] = flash[field->data - i];
+	}
+	return field->length;
+}
+
+// Append a header field behind the last one, as flash: bits only clear
+static BOOL writeHeaderField( unsigned char id, const unsigned char *field, int length )
+{
+	int addr = SIM_HEADER_END;
+	int i;
+
+	while ( addr > SIM_HEADER_START && flash[addr] != 0x00 && flash[addr] != 0xFF ) {
+		addr -= flash[addr] + 2;
+	}
+	if ( addr - length - 2 < SIM_HEADER_START ) {
+		return FALSE;
+	}
+
+	flash[addr] &= length;
+	flash[addr - 1] &= id;
+	for ( i = 0; i < length; i++ ) {
+		flash[addr - 2 - i] &= field[i];
+	}
+	return TRUE;
+}
+
+// Answer a complete request, t is when its last row was received
+static void handleRequest( long long t )
+{
+	unsigned char service = request[0];
+	int addr;
+	int length;
+	int i;
+
+	reply_len = 0;
+	reply_pos = 0;
+
+	if ( !authenticated && ( service == 0x31 || service == 0x34 || service == 0x36 ||
+							 service == 0x3B || service == 0x2C || service == 0x21 ) ) {
+		// Security access denied
+		negativeReply( service, 0x33 );
+		sendReplyRow( t );
+		return;
+	}
+
+	switch ( service ) {
+		case 0x1A:
+			// Read header field
+			length = simFindField( request[1], reply + 2 );
+			if ( length < 0 ) {
+				negativeReply( service, 0x31 );
+				break;
+			}
+			reply[0] = 0x5A;
+			reply[1] = request[1];
+			reply_len = length + 2;
+			break;
+
+		case 0x27:
+			// Security access, seed and key
+			if ( request[1] == 0x05 ) {
+				seed = (unsigned short)( t ^ ( t >> 16 ) );
+				if ( seed == 0 ) {
+					seed = 1;
+				}
+				reply[0] = 0x67;
+				reply[1] = 0x05;
+				reply[2] = seed >> 8;
+				reply[3] = seed & 0xFF;
+				reply_len = 4;
+			}
+			else if ( request[1] == 0x06 && seed &&
+					  ( ( request[2] << 8 ) | request[3] ) == authKey( seed ) ) {
+				authenticated = TRUE;
+				reply[0] = 0x67;
+				reply[1] = 0x06;
+				reply[2] = 0x34;
+				reply_len = 3;
+			}
+			else {
+				negativeReply( service, 0x35 );
+			}
+			break;
+
+		case 0x31:
+			// Routines: 0x52 prepare, 0x53 erase, 0x54 leave
+			if ( request[1] == 0x53 ) {
+				if ( erase_end_us == 0 ) {
+					memset( flash, 0xFF, sizeof( flash ) );
+					erase_end_us = t + sim_config.erase_ms * 1000;
+				}
+				if ( t < erase_end_us ) {
+					negativeReply( service, 0x21 );
+					break;
+				}
+				erase_end_us = 0;
+			}
+			reply[0] = 0x71;
+			reply[1] = request[1];
+			reply_len = 2;
+			break;
+
+		case 0x3E:
+			// Tester present
+			reply[0] = 0x7E;
+			reply_len = 1;
+			break;
+
+		case 0x34:
+			// Request download: 3 byte address, 4 byte length
+			addr = ( request[1] << 16 ) | ( request[2] << 8 ) | request[3];
+			length = ( request[4] << 24 ) | ( request[5] << 16 ) | ( request[6] << 8 ) | request[7];
+			if ( request_len < 8 || length < 0 || addr + length > T7SIM_FLASH_SIZE ) {
+				negativeReply( service, 0x31 );
+				break;
+			}
+			download_addr = addr;
+			download_end = addr + length;
+			reply[0] = 0x74;
+			reply_len = 1;
+			break;
+
+		case 0x36:
+			// Transfer data to the next address of the download
+			if ( download_addr + request_len - 1 > download_end ) {
+				negativeReply( service, 0x22 );
+				break;
+			}
+			for ( i = 1; i < request_len; i++ ) {
+				flash[download_addr++] &= request[i];
+			}
+			reply[0] = 0x76;
+			reply_len = 1;
+			break;
+
+		case 0x37:
+			download_addr = download_end = 0;
+			reply[0] = 0x77;
+			reply_len = 1;
+			break;
+
+		case 0x3B:
+			// Write header field
+			if ( request_len < 2 || !writeHeaderField( request[1], request + 2, request_len - 2 ) ) {
+				negativeReply( service, 0x31 );
+				break;
+			}
+			reply[0] = 0x7B;
+			reply[1] = request[1];
+			reply_len = 2;
+			break;
+
+		case 0x2C:
+			// Define record 0xF0 as length bytes from a 3 byte address
+			length = request[4];
+			addr = ( request[5] << 16 ) | ( request[6] << 8 ) | request[7];
+			if ( request_len < 8 || request[1] != 0xF0 || length == 0 ||
+				 length > sim_config.max_read_block || addr + length > T7SIM_FLASH_SIZE ) {
+				negativeReply( service, 0x31 );
+				break;
+			}
+			read_addr = addr;
+			read_len = length;
+			reply[0] = 0x6C;
+			reply[1] = 0xF0;
+			reply_len = 2;
+			break;
+
+		case 0x21:
+			// Read record 0xF0
+			if ( request[1] != 0xF0 || read_len == 0 ) {
+				negativeReply( service, 0x22 );
+				break;
+			}
+			reply[0] = 0x61;
+			reply[1] = 0xF0;
+			memcpy( reply + 2, flash + read_addr, read_len );
+			reply_len = read_len + 2;
+			break;
+
+		case 0x82:
+			read_len = 0;
+			reply[0] = 0xC2;
+			reply_len = 1;
+			break;
+
+		default:
+			negativeReply( service, 0x11 );
+			break;
+	}
+
+	sendReplyRow( t );
+}
+
+// A frame from the tool has been received by the ECU at time t
+static void handleFrame( const CANMsg *msg, long long t )
+{
+	CANMsg answer;
+	int k;
+
+	switch ( msg->id ) {
+		case 0x220:
+			// Initialization, answered on 0x238
+			memset( &answer, 0, sizeof( CANMsg ) );
+			answer.id = 0x238;
+			answer.len = 8;
+			answer.data[0] = 0x40;
+			answer.data[1] = 0xBF;
+			answer.data[2] = 0x21;
+			answer.data[3] = 0xC1;
+			answer.data[5] = 0x11;
+			answer.data[6] = 0x02;
+			answer.data[7] = 0x58;
+			scheduleFrame( &answer, t + sim_config.latency_us );
+			break;
+
+		case 0x266:
+			// Acknowledgement, releases the next row of the reply
+			if ( reply_rows_left > 0 && msg->data[3] == ( reply_last_row & 0xBF ) ) {
+				sendReplyRow( t );
+			}
+			break;
+
+		case 0x240:
+			if ( msg->data[0] & 0x40 ) {
+				request_len = msg->data[2];
+				request_fill = 0;
+				request_active = TRUE;
+				k = 3;
+			}
+			else if ( request_active ) {
+				k = 2;
+			}
+			else {
+				break;
+			}
+			for ( ; k < 8 && request_fill < SIM_MSG_MAX; k++ ) {
+				request[request_fill++] = msg->data[k];
+			}
+			if ( ( msg->data[0] & 0x3F ) == 0 ) {
+				request_active = FALSE;
+				reply_rows_left = 0;
+				handleRequest( t );
+			}
+			break;
+	}
+}
+
+static BOOL simSend( void *context, const CANMsg *msg )
+{
+	long long now = simNow();
+	long long start = now > bus_free_us ? now : bus_free_us;
+
+	(void)context;
+	bus_free_us = start + frameTime( msg->len );
+	handleFrame( msg, bus_free_us );
+	return TRUE;
+}
+
+static BOOL simReceive( void *context, CANMsg *msg )
+{
+	(void)context;
+	pollBus( simNow() );
+	if ( sim_rx_tail == sim_rx_head || sim_rx[sim_rx_tail & SIM_RX_MASK].due > simNow() ) {
+		return FALSE;
+	}
+	*msg = sim_rx[sim_rx_tail & SIM_RX_MASK].msg;
+	sim_rx_tail++;
+	return TRUE;
+}
+
+static BOOL simWait( void *context, long timeout_us )
+{
+	long long now;
+	long long next;
+	long slice;
+
+	(void)context;
+	while ( 1 ) {
+		now = simNow();
+		pollBus( now );
+		next = sim_rx_tail != sim_rx_head ? sim_rx[sim_rx_tail & SIM_RX_MASK].due : next_broadcast_us;
+		if ( sim_rx_tail != sim_rx_head && next <= now ) {
+			return TRUE;
+		}
+		if ( timeout_us <= 0 ) {
+			return FALSE;
+		}
+
+		slice = next - now < timeout_us ? (long)( next - now ) : timeout_us;
+		if ( slice < 1 ) {
+			slice = 1;
+		}
+		usleep( slice );
+		timeout_us -= slice;
+	}
+}
+
+// Something readable when no image is given: a boot signature, some
+// pseudo random code and data, erased space and a full header
+static void defaultImage( void )
+{
+	unsigned int x = 0x2F6E2B1;
+	int i;
+
+	memset( flash, 0xFF, sizeof( flash ) );
+	flash[0] = 0xFF;
+	flash[1] = 0xFF;
+	flash[2] = 0xEF;
+	flash[3] = 0xFC;
+	for ( i = 4; i < 0x60000; i++ ) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		flash[i] = x & 0xFF;
+	}
+	for ( i = 0; i < (int)( sizeof( default_header ) / sizeof( default_header[0] ) ); i++ ) {
+		writeHeaderField( default_header[i].id, (const unsigned char *)default_header[i].text,
+						  strlen( default_header[i].text ) );
+	}
+}
+
+void initT7SimConfig( T7SIM_CONFIG *config )
+{
+	config->bitrate = T7SIM_BITRATE_DEFAULT;
+	config->latency_us = T7SIM_LATENCY_DEFAULT;
+	config->erase_ms = T7SIM_ERASE_DEFAULT;
+	config->max_read_block = 0xFD;
+}
+
+// Load image_file (or the default image when NULL) into the simulated
+// flash and install the simulator as the transport
+BOOL startT7Sim( const T7SIM_CONFIG *config, const char *image_file )
+{
+	FILE *file;
+
+	sim_config = *config;
+	if ( sim_config.bitrate <= 0 ) {
+		sim_config.bitrate = T7SIM_BITRATE_DEFAULT;
+	}
+
+	if ( image_file ) {
+		if ( ( file = fopen( image_file, "rb" ) ) == NULL ) {
+			printf("Error: could not open simulator image %s\n", image_file );
+			return FALSE;
+		}
+		memset( flash, 0xFF, sizeof( flash ) );
+		fread( flash, 1, sizeof( flash ), file );
+		fclose( file );
+	}
+	else {
+		defaultImage();
+	}
+
+	sim_rx_head = sim_rx_tail = 0;
+	request_active = FALSE;
+	reply_rows_left = 0;
+	authenticated = FALSE;
+	seed = 0;
+	erase_end_us = 0;
+	download_addr = download_end = 0;
+	read_len = 0;
+	bus_free_us = next_broadcast_us = simNow();
+
+	setTransport( &sim_transport );
+	return TRUE;
+}
+
+void stopT7Sim()
+{
+	setTransport( NULL );
+}
+
+// The simulated flash, e.g. to compare with what was written
+unsigned char *getT7SimImage()
+{
+	return flash;
+}
@@ -0,0 +1,33 @@
+/*
+ *  trionic7_sim.h
+ *  saabopentechproj
+ *
+ *  Software Trionic 7 on a simulated CAN bus, installed as the transport
+ *  of lawcel_canusb_ftd2xx so reads and writes can run without a car.
+ *
+ */
+
+#ifndef TRIONIC7_SIM_H
+#define TRIONIC7_SIM_H
+
+#include "lawcel_canusb_ftd2xx.h"
+
+#define T7SIM_FLASH_SIZE		( 512 * 1024 )
+
+#define T7SIM_BITRATE_DEFAULT	500000	// P-Bus
+#define T7SIM_LATENCY_DEFAULT	500		// us from request to first reply frame
+#define T7SIM_ERASE_DEFAULT		2000	// ms
+
+typedef struct {
+	long bitrate;			// bus bitrate in bit/s
+	long latency_us;		// ECU turnaround for every frame it sends
+	long erase_ms;			// how long the flash erase takes
+	int max_read_block;		// largest 0x2C read size accepted
+} T7SIM_CONFIG;
+
+void initT7SimConfig( T7SIM_CONFIG *config );
+BOOL startT7Sim( const T7SIM_CONFIG *config, const char *image_file );
+void stopT7Sim();
+unsigned char *getT7SimImage();
+
+#endif